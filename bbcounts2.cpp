@@ -20,10 +20,59 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <cstring>
-#define FILEPATH "image.offset"
+#include <errno.h>
 #define CRASHFILE "crash.bin"
+/* exit status of a run stopped by -budget or -x */
+#define TIMEOUT_STATUS 124
+/* fork server pipes: requests are read from FORKSRV_FD, replies go to FORKSRV_FD+1 */
+#define FORKSRV_FD 198
+/* edge hitmap, shared with the fuzzer through a mmap'ed file */
+#define EDGE_MAP_SIZE 65536
+/*
+ * Blocks are reported by ID rather than by address, so that runs agree with
+ * ASLR on: the index of the image in the load table (0: main executable,
+ * 1..: the -l libraries in the order given, then libc for -libc) in the
+ * upper 32 bits, and the block's address minus the image load offset (its
+ * link-time address, as a disassembler shows it) in the lower 32 bits.
+ * The table of monitored images is written to imageOffset.txt.
+ */
+typedef UINT64 BBID;
+/* index of the images that are not monitored (only seen in call stacks) */
+#define UNMONITORED_IMAGE 0xffff
+/*
+ * binary output (-binout): "BBC1", UINT32 count, UINT32 sizeof(BBID),
+ * then count block IDs (BBID, ascending) and count buckets (UINT8,
+ * floor(log2(hits+1)), i.e. the value fitness takes from the frequency)
+ */
+#define BINOUT_MAGIC "BBC1"
+/*
+ * weight table (-weights), written by the fuzzer and mapped shared:
+ *   "BBW2", UINT32 count, UINT32 max frequency, UINT32 reserved,
+ *   count records {UINT64 block ID, double weight}, ascending,
+ *   count "seen" bytes, one per record, zero-padded to a multiple of 8,
+ *   the seen blocks that are not in the table: WEIGHT_SET_SLOTS block IDs
+ *   (UINT64) in an open-addressing table, see idSetAdd().
+ * The tool sets the seen bytes (adds the blocks) it reports as new; the
+ * fuzzer clears them when it starts a new generation.
+ */
+#define WEIGHT_MAGIC "BBW2"
+#define WEIGHT_SET_SLOTS 131072
+/*
+ * global coverage set (-seen), never cleared by the tool: SEEN_SLOTS block
+ * IDs (UINT64) in an open-addressing table, see idSetAdd()
+ */
+#define SEEN_SLOTS (1 << 20)
+/* -once: blocks hit for the first time are collected and their traces
+ * invalidated in batches of ONCE_BATCH, or as soon as an already hit block
+ * runs again (i.e. the program is in a loop).
+ */
+#define ONCE_BATCH 64
 
 using namespace std;
 
@@ -33,154 +82,997 @@ KNOB<UINT32> KnobLibC(KNOB_MODE_WRITEONCE, "pintool",
 			 "libc", "0", "if you want to monitor libc BB");
 KNOB<UINT32> KnobTimeout(KNOB_MODE_WRITEONCE, "pintool",
 			 "x", "10000", "specify timeout in miliseconds");
+KNOB<UINT64> KnobBudget(KNOB_MODE_WRITEONCE, "pintool",
+			 "budget", "0", "exit with status 124 after this many executed instructions (0: no limit)");
 KNOB<string> KnobXLibraries(KNOB_MODE_WRITEONCE, "pintool",
     "l", "", "specify shared lobraries to be monitored, separated by comma (no spaces)");
+KNOB<UINT32> KnobForkServer(KNOB_MODE_WRITEONCE, "pintool",
+			 "forkserver", "0", "stop at the entry point and fork a child per request on the control pipe");
+KNOB<ADDRINT> KnobForkAddr(KNOB_MODE_WRITEONCE, "pintool",
+			 "fsaddr", "0", "address to start the fork server at (default: entry point of the main executable)");
+KNOB<UINT32> KnobBinOut(KNOB_MODE_WRITEONCE, "pintool",
+			 "binout", "0", "write the output file as sorted (block, log2 bucket) arrays instead of text");
+KNOB<string> KnobWeights(KNOB_MODE_WRITEONCE, "pintool",
+    "weights", "", "BB weight table; enables the fitness output");
+KNOB<string> KnobErrorBB(KNOB_MODE_WRITEONCE, "pintool",
+    "errorbb", "", "file of error BB addresses (hex, one per line)");
+KNOB<string> KnobFitness(KNOB_MODE_WRITEONCE, "pintool",
+    "fitness", "fitness.out", "specify fitness output file name (with -weights)");
+KNOB<string> KnobSeen(KNOB_MODE_WRITEONCE, "pintool",
+    "seen", "", "global coverage set shared by all runs; blocks new to it are written to -newbb");
+KNOB<string> KnobNewBB(KNOB_MODE_WRITEONCE, "pintool",
+    "newbb", "newbb.out", "specify output file name for new blocks (with -seen)");
+KNOB<string> KnobEdgeMap(KNOB_MODE_WRITEONCE, "pintool",
+    "edgemap", "", "also count edges (prev block ^ cur block) in this 64 KB file, mapped shared");
+KNOB<string> KnobPersistFn(KNOB_MODE_WRITEONCE, "pintool",
+    "persist_fn", "", "run this function (symbol or 0x address) in a loop, one input per iteration");
+KNOB<UINT32> KnobPersistIters(KNOB_MODE_WRITEONCE, "pintool",
+			 "persist_iters", "1000", "iterations of -persist_fn before the process exits");
+KNOB<INT32> KnobPersistBuf(KNOB_MODE_WRITEONCE, "pintool",
+			 "persist_buf", "-1", "index of the input buffer argument of -persist_fn (-1: it reads the input itself)");
+KNOB<INT32> KnobPersistLen(KNOB_MODE_WRITEONCE, "pintool",
+			 "persist_len", "-1", "index of the input length argument of -persist_fn (with -persist_buf)");
+KNOB<UINT32> KnobPersistMax(KNOB_MODE_WRITEONCE, "pintool",
+			 "persist_max", "1048576", "size of the input buffer of -persist_buf; longer inputs are cut");
+KNOB<string> KnobPersistInput(KNOB_MODE_WRITEONCE, "pintool",
+    "persist_input", "", "file that the input of each iteration is read from (with -persist_buf)");
+KNOB<string> KnobCost(KNOB_MODE_WRITEONCE, "pintool",
+    "cost", "", "write the cost of the run (blocks, instructions, syscalls, peak RSS, wall time) to this file");
+KNOB<UINT32> KnobOnce(KNOB_MODE_WRITEONCE, "pintool",
+			 "once", "0", "only record whether a block ran (count 1) and drop its instrumentation after the first hit");
 
 static FILE* trace;
 static FILE* offsets;
-static int ioffset;
-static char *offsetmap;
-off_t sz;
 //static map<long unsigned int, int> bbcount;
 //static pair<map<long unsigned int, int>::iterator, bool> ret;
-static map<ADDRINT, unsigned int> bbcount;
-static pair<map<ADDRINT, unsigned int>::iterator, bool> ret;
+/* block ID -> dense counter index; only touched at instrumentation time */
+static map<BBID, UINT32> bbindex;
+/*
+ * counters live in fixed chunks that never move, so the chunk and offset of
+ * a BBL's counter can be baked into the instrumentation. Chunks are sized
+ * from the monitored image ranges (one counter per BB_AVG_SIZE bytes of
+ * image); every thread has its own copy of each chunk.
+ */
+#define BB_AVG_SIZE 8
+#define BB_CHUNK_MIN 4096
+#define BB_CHUNK_MAX 256
+static vector<UINT32> bbchunks;
+static UINT32 bbnext = 0;
+static UINT32 bbfree = 0;
 PIN_THREAD_UID threadUid;
-static vector<pair<ADDRINT,ADDRINT> > allAddr;
+/* load table: every image loaded, monitored or not */
+typedef struct
+{
+  ADDRINT low;
+  ADDRINT high;
+  ADDRINT offset;
+  UINT32 index;
+} image_t;
+static vector<image_t> images;
 static vector<string> libNames;
 static FILE* crashFD;
-#define LAST_EXECUTED_BB 10  
-ADDRINT LastExecutedBB[LAST_EXECUTED_BB]={};  
-UINT32 LastExecutedPosBB=0;
-#define LAST_EXECUTED_Rtn 5  
-ADDRINT LastExecutedRtn[LAST_EXECUTED_Rtn]={};  
-UINT32 LastExecutedPosRtn=0;
+#define CRASHTRACE "crash.trace"
+/* ring of the last monitored BBs executed (size must be a power of two) */
+#define LAST_EXECUTED_BB 16
+/* number of innermost frames in the crash bucket */
+#define LAST_EXECUTED_Rtn 5
+/* shadow call stack of monitored code: call target and return address per
+ * frame, and the hash of all frames up to (not including) each depth, so
+ * pushing and popping a frame is O(1). Frames deeper than SHADOW_STACK_MAX
+ * are only counted.
+ */
+#define SHADOW_STACK_MAX 1024
+#define SHADOW_RET_SCAN 8
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+/*
+ * Per-thread state: the thread's counter chunks, crash fingerprints and
+ * previous block of the edge map, so that no analysis routine writes to
+ * anything another thread writes to (except the edge map bytes, as AFL).
+ * Analysis routines get it from a tool register set at thread start; it
+ * is kept after the thread exits, as the counts of all threads are summed
+ * when they are written.
+ */
+typedef struct
+{
+  UINT32 *chunks[BB_CHUNK_MAX];
+  ADDRINT LastExecutedBB[LAST_EXECUTED_BB];
+  UINT32 LastExecutedPosBB;
+  ADDRINT shadowTarget[SHADOW_STACK_MAX];
+  ADDRINT shadowRet[SHADOW_STACK_MAX];
+  UINT32 shadowKey[SHADOW_STACK_MAX];
+  UINT32 shadowHash[SHADOW_STACK_MAX + 1];
+  UINT32 shadowDepth;
+  UINT32 prevLoc;
+  UINT64 icount;
+  UINT64 syscalls;
+} thread_data_t;
+static vector<thread_data_t *> threads;
+static PIN_LOCK threadLock;
+static PIN_LOCK onceLock;
+static REG tdReg;
+static TLS_KEY tdKey;
+static ADDRINT forkAddr = 0;
+static BOOL forkStarted = FALSE;
+static CONTEXT persistCtx;
+static UINT32 persistDepth = 0;
+static UINT32 persistIter = 0;
+static BOOL persistStarted = FALSE;
+static BOOL persistOff = FALSE;
+static char *persistBuf = NULL;
+static UINT8 *edgemap = NULL;
+static UINT64 *seenmap = NULL;
+static INT64 budget = 0;
+static struct timeval runStart;
+typedef struct
+{
+  UINT64 addr;
+  double weight;
+} weight_rec_t;
+static weight_rec_t *weights = NULL;
+static UINT32 nweights = 0;
+static UINT32 maxfreq = 0;
+static UINT8 *wseen = NULL;
+static UINT64 *wset = NULL;
+static set<BBID> errorbb;
+/* per dense index: weight, error flag and seen byte of the block (NULL: in wset) */
+static vector<double> bbweight;
+static vector<UINT8> bberror;
+static vector<UINT8 *> bbseen;
+static vector<ADDRINT> oncePending;
 
 
+BBID blockId(ADDRINT addr)
+{
+  for (vector<image_t>::iterator it=images.begin();it!=images.end();++it)
+    if (addr >= it->low && addr <= it->high)
+      return ((BBID)it->index << 32) | (UINT32)(addr - it->offset);
+  return ((BBID)UNMONITORED_IMAGE << 32) | (UINT32)addr;
+}
+
+/* 32-bit key of a block ID for hashing */
+UINT32 idKey(BBID id)
+{
+  return (UINT32)id ^ ((UINT32)(id >> 32) * FNV_PRIME);
+}
+
+/*
+ * Exact set of block IDs in shared memory: open addressing with linear
+ * probing over a power of two slots, 0 (never a block ID) marks a free
+ * slot. Adds id; TRUE if it was not in the set. A full set reports every
+ * block that is not in it as new.
+ */
+BOOL idSetAdd(UINT64 *set, UINT32 slots, BBID id)
+{
+  UINT32 h = idKey(id) * 0x9e3779b1U;
+
+  h ^= h >> 16;
+  for (UINT32 i = 0; i < slots; i++)
+    {
+      UINT64 *slot = &set[(h + i) & (slots - 1)];
+      if (*slot == id) return FALSE;
+      if (*slot == 0)
+	{
+	  *slot = id;
+	  return TRUE;
+	}
+    }
+  return TRUE;
+}
+
 //catching excpetions
 //SIGNAL_INTERCEPT_CALLBACK 
 //EXCEPT_HANDLING_RESULT ExceptionHandling(THREADID tid, EXCEPTION_INFO *pExceptInfo, PHYSICAL_CONTEXT *pPhysCtxt, VOID *v)
 //VOID ExceptionHandling(THREADID threadIndex, CONTEXT_CHANGE_REASON reason, const CONTEXT *from, CONTEXT *to, INT32 info, VOID *v)
+/* Crash bucket: hash of the signal, the last monitored BB executed and the
+ * call targets of the LAST_EXECUTED_Rtn innermost frames. It does not depend
+ * on how the crashing function was reached beyond those frames, nor on the
+ * path taken inside it, so the same bug gives the same bucket.
+ */
+UINT32 crashBucket(thread_data_t *td, INT32 sig)
+{
+  UINT32 h = FNV_OFFSET;
+  UINT32 d = td->shadowDepth < SHADOW_STACK_MAX ? td->shadowDepth : SHADOW_STACK_MAX;
+  UINT32 i;
+  h = (h ^ (UINT32)sig) * FNV_PRIME;
+  h = (h ^ idKey(blockId(td->LastExecutedBB[(td->LastExecutedPosBB - 1) & (LAST_EXECUTED_BB - 1)]))) * FNV_PRIME;
+  for (i = d; i > 0 && d - i < LAST_EXECUTED_Rtn; i--)
+    h = (h ^ td->shadowKey[i - 1]) * FNV_PRIME;
+  return h;
+}
+
+/* crash.bin holds only the bucket ID (the fuzzer dedups crashes by its
+ * hash); the details go to crash.trace. Both come from the crashing thread.
+ */
 BOOL ExceptionHandling(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler, const EXCEPTION_INFO *pExceptInfo, VOID *v) 
 {
   UINT32 i;
+  thread_data_t *td = (thread_data_t *)PIN_GetThreadData(tdKey, tid);
+  if (td == NULL)
+    return TRUE;
+  UINT32 d = td->shadowDepth < SHADOW_STACK_MAX ? td->shadowDepth : SHADOW_STACK_MAX;
   crashFD=fopen(CRASHFILE,"w");
-  fprintf(crashFD,"%d",sig);
-  //fprintf(crashFD,"%p",(void *) PIN_GetExceptionAddress(pExceptInfo));
-  //fprintf(crashFD,"%p",(void *) PIN_GetContextReg(ctxt,REG_INST_PTR));  	
+  if (crashFD == NULL)
+    return TRUE;
+  fprintf(crashFD,"%d:%08x\n",sig,crashBucket(td, sig));
+  fclose(crashFD);
+  crashFD=fopen(CRASHTRACE,"w");
+  if (crashFD == NULL)
+    return TRUE;
+  fprintf(crashFD,"signal %d\nbucket %08x\nthread %u\n",sig,crashBucket(td, sig),tid);
+  fprintf(crashFD,"ip %p\n",(void *) PIN_GetContextReg(ctxt,REG_INST_PTR));
+  fprintf(crashFD,"depth %u\nstack %08x\n",td->shadowDepth,td->shadowHash[d]);
+  for (i = d; i > 0; i--)
+    fprintf(crashFD,"frame 0x%llx\n",(unsigned long long)blockId(td->shadowTarget[i - 1]));
+  /* oldest first */
   for(i=0;i<LAST_EXECUTED_BB;i++)
-  {
-
-    fprintf(crashFD,"%p",(void *)LastExecutedBB[LastExecutedPosBB]);
-    LastExecutedPosBB = (LastExecutedPosBB+1)%LAST_EXECUTED_BB;
-  }
-  for(i=0;i<LAST_EXECUTED_Rtn;i++)
-  {
-    fprintf(crashFD,"%p",(void *)LastExecutedRtn[LastExecutedPosRtn]);
-    LastExecutedPosRtn = (LastExecutedPosRtn+1)%LAST_EXECUTED_Rtn;
-  }
+    {
+      ADDRINT bb = td->LastExecutedBB[(td->LastExecutedPosBB + i) & (LAST_EXECUTED_BB - 1)];
+      if (bb != 0)
+	fprintf(crashFD,"bb 0x%llx\n",(unsigned long long)blockId(bb));
+    }
   fclose(crashFD);
   return TRUE;
   //return EHR_CONTINUE_SEARCH;
 }
 
-VOID call_direct(ADDRINT target)
+VOID PIN_FAST_ANALYSIS_CALL recordBlock(thread_data_t *td, ADDRINT bbl)
 {
-  LastExecutedRtn[LastExecutedPosRtn]= target;
-  LastExecutedPosRtn = (LastExecutedPosRtn+1)% LAST_EXECUTED_Rtn;
+  td->LastExecutedBB[td->LastExecutedPosBB] = bbl;
+  td->LastExecutedPosBB = (td->LastExecutedPosBB + 1) & (LAST_EXECUTED_BB - 1);
 }
 
-VOID call_indirect(ADDRINT target, BOOL taken)
+VOID shadowPush(thread_data_t *td, ADDRINT target, ADDRINT ret, UINT32 key)
+{
+  UINT32 d = td->shadowDepth;
+  if (d < SHADOW_STACK_MAX)
+    {
+      td->shadowTarget[d] = target;
+      td->shadowRet[d] = ret;
+      td->shadowKey[d] = key;
+      td->shadowHash[d + 1] = (td->shadowHash[d] ^ key) * FNV_PRIME;
+    }
+  td->shadowDepth++;
+}
+
+/* key: idKey of the target, computed at instrumentation time */
+VOID call_direct(thread_data_t *td, ADDRINT target, ADDRINT ret, UINT32 key)
+{
+  shadowPush(td, target, ret, key);
+}
+
+VOID call_indirect(thread_data_t *td, ADDRINT target, BOOL taken, ADDRINT ret)
 {
   if (!taken) return;
-  LastExecutedRtn[LastExecutedPosRtn]= target;
-  LastExecutedPosRtn = (LastExecutedPosRtn+1)% LAST_EXECUTED_Rtn;
+  shadowPush(td, target, ret, idKey(blockId(target)));
+}
+
+/* Pops back to the frame the return address belongs to. Frames whose return
+ * was not seen (longjmp, tail calls, returns in unmonitored code) are dropped
+ * with it; a return that matches none of the top frames leaves the stack alone.
+ */
+VOID do_return(thread_data_t *td, ADDRINT target)
+{
+  UINT32 i;
+  if (td->shadowDepth > SHADOW_STACK_MAX)
+    {
+      td->shadowDepth--;
+      return;
+    }
+  for (i = td->shadowDepth; i > 0 && td->shadowDepth - i < SHADOW_RET_SCAN; i--)
+    if (td->shadowRet[i - 1] == target)
+      {
+	td->shadowDepth = i - 1;
+	return;
+      }
+}
+
+
+UINT32 *allocChunk(UINT32 n)
+{
+  UINT32 *chunk = (UINT32 *)calloc(n, sizeof(UINT32));
+  if (chunk == NULL)
+    {
+      perror("Error allocating BB counters");
+      exit(0);
+    }
+  return chunk;
+}
+
+/* a new chunk, for every thread started so far (later ones get it at start) */
+VOID allocCounters(ADDRINT low, ADDRINT high)
+{
+  UINT32 n = (high - low + 1) / BB_AVG_SIZE;
+  if (n < BB_CHUNK_MIN) n = BB_CHUNK_MIN;
+  PIN_GetLock(&threadLock, PIN_ThreadId() + 1);
+  if (bbchunks.size() >= BB_CHUNK_MAX)
+    {
+      fprintf(stderr, "Too many BB counter chunks\n");
+      exit(0);
+    }
+  for (vector<thread_data_t *>::iterator it=threads.begin();it!=threads.end();++it)
+    (*it)->chunks[bbchunks.size()] = allocChunk(n);
+  bbchunks.push_back(n);
+  PIN_ReleaseLock(&threadLock);
+  bbfree += n;
 }
 
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+  thread_data_t *td = (thread_data_t *)calloc(1, sizeof(thread_data_t));
+  if (td == NULL)
+    {
+      perror("Error allocating thread data");
+      exit(0);
+    }
+  td->shadowHash[0] = FNV_OFFSET;
+  PIN_GetLock(&threadLock, tid + 1);
+  for (UINT32 i = 0; i < bbchunks.size(); i++)
+    td->chunks[i] = allocChunk(bbchunks[i]);
+  threads.push_back(td);
+  PIN_ReleaseLock(&threadLock);
+  PIN_SetThreadData(tdKey, td, tid);
+  PIN_SetContextReg(ctxt, tdReg, (ADDRINT)td);
+}
+
+/* look a new block up in the weight table; blocks not in it weigh 1 */
+VOID addWeight(BBID bb)
+{
+  UINT32 lo = 0, hi = nweights;
+  while (lo < hi)
+    {
+      UINT32 mid = lo + (hi - lo) / 2;
+      if (weights[mid].addr < bb) lo = mid + 1;
+      else hi = mid;
+    }
+  if (lo < nweights && weights[lo].addr == bb)
+    {
+      bbweight.push_back(weights[lo].weight);
+      bbseen.push_back(wseen + lo);
+    }
+  else
+    {
+      bbweight.push_back(1.0);
+      bbseen.push_back(NULL);
+    }
+  bberror.push_back(errorbb.count(bb) ? 1 : 0);
+}
+
+/* locate the chunk holding a dense index */
+VOID chunkOf(UINT32 idx, UINT32 *chunk, UINT32 *off)
+{
+  UINT32 c;
+  for (c = 0; idx >= bbchunks[c]; c++)
+    idx -= bbchunks[c];
+  *chunk = c;
+  *off = idx;
+}
+
+/* hits of a block, summed over all threads */
+UINT32 countAt(UINT32 idx)
+{
+  UINT32 c, off, count = 0;
+  chunkOf(idx, &c, &off);
+  PIN_GetLock(&threadLock, PIN_ThreadId() + 1);
+  for (vector<thread_data_t *>::iterator it=threads.begin();it!=threads.end();++it)
+    count += (*it)->chunks[c][off];
+  PIN_ReleaseLock(&threadLock);
+  return count;
+}
+
+UINT32 getIndex(ADDRINT addr)
+{
+  BBID bb = blockId(addr);
+  pair<map<BBID, UINT32>::iterator, bool> ret = bbindex.insert(std::make_pair(bb, bbnext));
+  if (ret.second)
+    {
+      if (weights != NULL) addWeight(bb);
+      if (bbfree == 0) allocCounters(0, 0);
+      bbnext++;
+      bbfree--;
+    }
+  return ret.first->second;
+}
+
+VOID instrumentPersist(IMG img);
 
 VOID ImageLoad(IMG img, VOID *v)
 {
+  image_t image;
+  if (!KnobPersistFn.Value().empty())
+    instrumentPersist(img);
+  image.low = IMG_LowAddress(img);
+  image.high = IMG_HighAddress(img);
+  image.offset = IMG_LoadOffset(img);
+  image.index = UNMONITORED_IMAGE;
   if(IMG_IsMainExecutable(img))
     {
-      //cout<<"[*]adding main executable addresses at"<<StringFromAddrint(IMG_LoadOffset(img))<<endl;
-      fprintf(offsets, "Main: %s\n",StringFromAddrint(IMG_LoadOffset(img)).c_str());
-      fflush(offsets);
-      allAddr.push_back(std::make_pair(IMG_LowAddress(img), IMG_HighAddress(img)));
-	}
+      image.index = 0;
+      if (KnobForkServer.Value() > 0 && KnobPersistFn.Value().empty())
+	forkAddr = KnobForkAddr.Value() ? KnobForkAddr.Value() : IMG_Entry(img);
+    }
   else
     {
-      //cout<<"[*] "<<IMG_Name(img)<< "is loaded...at offset"<<StringFromAddrint(IMG_LoadOffset(img))<<endl;
-      // lets check for libc monitoring first
-        if (KnobLibC.Value() > 0)
-        {
-            if (IMG_Name(img).find("libc.")!=std::string::npos)
-	      allAddr.push_back(std::make_pair(IMG_LowAddress(img), IMG_HighAddress(img)));
-        }
-      for (vector<string>::iterator it=libNames.begin();it !=libNames.end();++it)
+      for (UINT32 i = 0; i < libNames.size(); i++)
 	{
-	  if (IMG_Name(img).find(*it)!=std::string::npos)
+	  if (IMG_Name(img).find(libNames[i])!=std::string::npos)
 	    {
-	      //cout<<"[*] "<<IMG_Name(img)<< "is being added."<<endl;
-	      fprintf(offsets, "%s: %s\n",IMG_Name(img).c_str(),StringFromAddrint(IMG_LoadOffset(img)).c_str());
-	      std::memcpy(offsetmap,StringFromAddrint(IMG_LoadOffset(img)).c_str(),18);
-	      fflush(offsets);
-	      allAddr.push_back(std::make_pair(IMG_LowAddress(img), IMG_HighAddress(img)));
-		}
+	      image.index = i + 1;
+	      break;
+	    }
 	}
+      if (image.index == UNMONITORED_IMAGE && KnobLibC.Value() > 0 &&
+	  IMG_Name(img).find("libc.")!=std::string::npos)
+	image.index = libNames.size() + 1;
     }
+  images.push_back(image);
+  if (image.index == UNMONITORED_IMAGE)
+    return;
+  fprintf(offsets, "%u %s: %s\n", image.index, IMG_Name(img).c_str(), StringFromAddrint(image.offset).c_str());
+  fflush(offsets);
+  allocCounters(image.low, image.high);
 }
 
 BOOL isMonitoredAddress(ADDRINT bb)
 {
-  for(vector<pair<ADDRINT,ADDRINT> >::iterator it=allAddr.begin();it!=allAddr.end();++it)
+  for(vector<image_t>::iterator it=images.begin();it!=images.end();++it)
     {
-      if ((bb >= (*it).first )&&(bb <= (*it).second)) return true;
+      if (it->index != UNMONITORED_IMAGE && bb >= it->low && bb <= it->high) return true;
     }
   return false;
 }
 
-VOID PIN_FAST_ANALYSIS_CALL rememberBlock(ADDRINT bbl)
+/* a single add to the thread's own counter, so that Pin inlines it */
+VOID PIN_FAST_ANALYSIS_CALL rememberBlock(thread_data_t *td, UINT32 chunk, UINT32 off)
+{
+  td->chunks[chunk][off]++;
+}
+
+/* -once: retranslated traces leave out the blocks already hit (see Trace) */
+VOID onceBlock(thread_data_t *td, UINT32 chunk, UINT32 off, ADDRINT bbl, THREADID tid)
+{
+  UINT32 *counter = td->chunks[chunk] + off;
+  vector<ADDRINT> flush;
+
+  PIN_GetLock(&onceLock, tid + 1);
+  if (*counter == 0)
+    {
+      *counter = 1;
+      oncePending.push_back(bbl);
+      if (oncePending.size() >= ONCE_BATCH)
+	flush.swap(oncePending);
+    }
+  else
+    flush.swap(oncePending);
+  PIN_ReleaseLock(&onceLock);
+  for (vector<ADDRINT>::iterator it=flush.begin();it!=flush.end();++it)
+    CODECACHE_InvalidateRange(*it, *it);
+}
+
+/* -cost: instructions executed by the thread; branch free so that Pin inlines it */
+VOID PIN_FAST_ANALYSIS_CALL countIns(thread_data_t *td, UINT32 n)
+{
+  td->icount += n;
+}
+
+VOID SyscallEntry(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v)
+{
+  thread_data_t *td = (thread_data_t *)PIN_GetThreadData(tdKey, tid);
+  if (td != NULL) td->syscalls++;
+}
+
+/* instructions left of -budget, shared by all threads (a lost update only
+ * lets a run go a little over); branch free so that Pin inlines it */
+ADDRINT PIN_FAST_ANALYSIS_CALL budgetTick(UINT32 n)
+{
+  budget -= n;
+  return budget < 0;
+}
+
+VOID budgetOver()
+{
+  PIN_ExitApplication(TIMEOUT_STATUS);
+}
+
+/* AFL-style: the edge is indexed by the two block ids; branch free so that Pin inlines it */
+VOID PIN_FAST_ANALYSIS_CALL rememberEdge(thread_data_t *td, UINT32 cur)
+{
+  edgemap[cur ^ td->prevLoc]++;
+  td->prevLoc = cur >> 1;
+}
+
+UINT32 edgeId(ADDRINT addr)
+{
+  UINT32 bb = idKey(blockId(addr));
+  return ((bb >> 4) ^ (bb << 8)) & (EDGE_MAP_SIZE - 1);
+}
+
+VOID writeCountsBin(FILE *f)
+{
+  map<BBID,UINT32>::iterator bb;
+  vector<BBID> addrs;
+  vector<UINT8> buckets;
+  UINT32 hdr[2];
+
+  for (bb=bbindex.begin();bb!=bbindex.end();++bb)
+    {
+      UINT32 count = countAt(bb->second);
+      UINT8 bucket = 0;
+      if (count == 0) continue;
+      for (UINT64 c = (UINT64)count + 1; c > 1; c >>= 1) bucket++;
+      addrs.push_back(bb->first);
+      buckets.push_back(bucket);
+    }
+  hdr[0] = addrs.size();
+  hdr[1] = sizeof(BBID);
+  /* one write() for the whole output */
+  string buf(BINOUT_MAGIC);
+  buf.append((const char *)hdr, sizeof(hdr));
+  if (!addrs.empty())
+    {
+      buf.append((const char *)&addrs[0], addrs.size() * sizeof(BBID));
+      buf.append((const char *)&buckets[0], buckets.size());
+    }
+  fflush(f);
+  if (write(fileno(f), buf.data(), buf.size()) != (ssize_t)buf.size())
+    perror("Error writing output");
+}
+
+VOID writeCounts(FILE *f)
 {
-  bbcount[bbl]=bbcount[bbl]+1;
-   
+  map<BBID,UINT32>::iterator bb;
+  if (KnobBinOut.Value() > 0)
+    {
+      writeCountsBin(f);
+      return;
+    }
+  for (bb=bbindex.begin();bb!=bbindex.end();++bb)
+    {
+      UINT32 count = countAt(bb->second);
+      if (count == 0) continue;
+      fprintf(f, "0x%llx %u\n", (unsigned long long)bb->first, count);
+    }
+}
+
+/*
+ * Fitness of the run, as gautils.fitnesCal2 computes it from the counts:
+ * every executed block adds lg = floor(log2(min(hits, maxfreq) + 1)) times
+ * its weight, error blocks add lg times a negative weight that depends on
+ * the number of blocks and error blocks. That weight uses fuzzer settings,
+ * so the output holds the partial sums and the fuzzer finishes the sum:
+ *   score errlg numEBB numBB bbNum
+ *   new-block new-block ...
+ * where new blocks are the non-error blocks not seen in this generation.
+ */
+VOID writeFitness()
+{
+  map<BBID,UINT32>::iterator bb;
+  double score = 0.0;
+  UINT64 errlg = 0;
+  UINT32 numEBB = 0, numBB = 0, bbNum = 0;
+  vector<BBID> fresh;
+  FILE *f;
+
+  for (bb=bbindex.begin();bb!=bbindex.end();++bb)
+    {
+      UINT32 idx = bb->second;
+      UINT32 count = countAt(bb->second);
+      UINT32 lg = 0;
+      if (count == 0) continue;
+      if (maxfreq && count > maxfreq) count = maxfreq;
+      for (UINT64 c = (UINT64)count + 1; c > 1; c >>= 1) lg++;
+      numBB++;
+      if (bberror[idx])
+	{
+	  numEBB++;
+	  errlg += lg;
+	  continue;
+	}
+      score += lg * bbweight[idx];
+      bbNum++;
+      if (bbseen[idx] == NULL)
+	{
+	  if (idSetAdd(wset, WEIGHT_SET_SLOTS, bb->first))
+	    fresh.push_back(bb->first);
+	}
+      else if (!*bbseen[idx])
+	{
+	  *bbseen[idx] = 1;
+	  fresh.push_back(bb->first);
+	}
+    }
+  f = fopen(KnobFitness.Value().c_str(), "w");
+  if (f == NULL) return;
+  fprintf(f, "%.17g %llu %u %u %u\n", score, (unsigned long long)errlg, numEBB, numBB, bbNum);
+  for (vector<BBID>::iterator it=fresh.begin();it!=fresh.end();++it)
+    fprintf(f, "0x%llx ", (unsigned long long)*it);
+  fprintf(f, "\n");
+  fclose(f);
+}
+
+/*
+ * cost of the run (-cost), one line:
+ *   blocks instructions syscalls peak-RSS-KB wall-ms
+ * blocks counts executions of monitored blocks, instructions and syscalls
+ * are those of the whole program (all threads). The peak RSS includes Pin
+ * itself and, in persistent mode, earlier iterations.
+ */
+VOID writeCost()
+{
+  map<BBID,UINT32>::iterator bb;
+  UINT64 blocks = 0, icount = 0, syscalls = 0;
+  struct timeval now;
+  struct rusage ru;
+  FILE *f;
+
+  for (bb=bbindex.begin();bb!=bbindex.end();++bb)
+    blocks += countAt(bb->second);
+  for (vector<thread_data_t *>::iterator it=threads.begin();it!=threads.end();++it)
+    {
+      icount += (*it)->icount;
+      syscalls += (*it)->syscalls;
+    }
+  gettimeofday(&now, NULL);
+  memset(&ru, 0, sizeof(ru));
+  getrusage(RUSAGE_SELF, &ru);
+  f = fopen(KnobCost.Value().c_str(), "w");
+  if (f == NULL) return;
+  fprintf(f, "%llu %llu %llu %ld %ld\n", (unsigned long long)blocks, (unsigned long long)icount,
+	  (unsigned long long)syscalls, (long)ru.ru_maxrss,
+	  (long)((now.tv_sec - runStart.tv_sec) * 1000 + (now.tv_usec - runStart.tv_usec) / 1000));
+  fclose(f);
+}
+
+/*
+ * add the executed blocks to the global coverage set; the ones that
+ * were not marked yet are written to -newbb (their count, then the blocks)
+ */
+VOID writeNew()
+{
+  map<BBID,UINT32>::iterator bb;
+  vector<BBID> fresh;
+  FILE *f;
+
+  for (bb=bbindex.begin();bb!=bbindex.end();++bb)
+    {
+      if (countAt(bb->second) == 0) continue;
+      if (idSetAdd(seenmap, SEEN_SLOTS, bb->first))
+	fresh.push_back(bb->first);
+    }
+  f = fopen(KnobNewBB.Value().c_str(), "w");
+  if (f == NULL) return;
+  fprintf(f, "%u\n", (UINT32)fresh.size());
+  for (vector<BBID>::iterator it=fresh.begin();it!=fresh.end();++it)
+    fprintf(f, "0x%llx ", (unsigned long long)*it);
+  fprintf(f, "\n");
+  fclose(f);
+}
+
+/* map a file of the given size shared with the fuzzer (created if needed) */
+UINT8 *mapShared(const string &path, size_t size, const char *what)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  UINT8 *p;
+
+  if (fd == -1 || ftruncate(fd, size) == -1)
+    {
+      fprintf(stderr, "Error opening %s %s: %s\n", what, path.c_str(), strerror(errno));
+      exit(0);
+    }
+  p = (UINT8 *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    {
+      fprintf(stderr, "Error mmapping %s %s: %s\n", what, path.c_str(), strerror(errno));
+      exit(0);
+    }
+  return p;
+}
+
+VOID loadWeights()
+{
+  struct stat st;
+  UINT32 hdr[4];
+  char *wmap;
+  int fd = open(KnobWeights.Value().c_str(), O_RDWR);
+
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(hdr))
+    {
+      perror("Error opening weight table");
+      exit(0);
+    }
+  wmap = (char *)mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (wmap == MAP_FAILED)
+    {
+      perror("Error mmapping weight table");
+      exit(0);
+    }
+  memcpy(hdr, wmap, sizeof(hdr));
+  if (memcmp(wmap, WEIGHT_MAGIC, 4) != 0 ||
+      st.st_size < (off_t)(sizeof(hdr) + hdr[1] * sizeof(weight_rec_t) + ((hdr[1] + 7) & ~7U) +
+			   WEIGHT_SET_SLOTS * sizeof(UINT64)))
+    {
+      fprintf(stderr, "Bad weight table %s\n", KnobWeights.Value().c_str());
+      exit(0);
+    }
+  nweights = hdr[1];
+  maxfreq = hdr[2];
+  weights = (weight_rec_t *)(wmap + sizeof(hdr));
+  wseen = (UINT8 *)(weights + nweights);
+  wset = (UINT64 *)(wseen + ((nweights + 7) & ~7U));
+
+  if (!KnobErrorBB.Value().empty())
+    {
+      FILE *ef = fopen(KnobErrorBB.Value().c_str(), "r");
+      unsigned long long addr;
+      if (ef != NULL)
+	{
+	  while (fscanf(ef, "%llx", &addr) == 1)
+	    errorbb.insert((BBID)addr);
+	  fclose(ef);
+	}
+    }
+}
+
+/*
+ * Fork server. Pin and the application are set up once; when execution
+ * reaches forkAddr, the process stops and serves requests:
+ *   - a 4-byte hello is written to FORKSRV_FD+1 (if that fails, nobody is
+ *     listening and the program just runs normally);
+ *   - every 4-byte request read from FORKSRV_FD forks a child, which keeps
+ *     the code cache compiled so far, zeroes the counters and runs the
+ *     program to completion (its Fini writes the output file as usual);
+ *   - the server replies with the child's pid and its wait status (4 bytes
+ *     each) and waits for the next request. EOF on FORKSRV_FD ends it.
+ * The input has to be at the same path for every run (the command line is
+ * fixed); the fuzzer rewrites that file before each request.
+ */
+VOID resetCounters()
+{
+  for (vector<thread_data_t *>::iterator it=threads.begin();it!=threads.end();++it)
+    {
+      thread_data_t *td = *it;
+      for (UINT32 i = 0; i < bbchunks.size(); i++)
+	memset(td->chunks[i], 0, bbchunks[i] * sizeof(UINT32));
+      memset(td->LastExecutedBB, 0, sizeof(td->LastExecutedBB));
+      td->LastExecutedPosBB = 0;
+      td->shadowDepth = 0;
+      td->prevLoc = 0;
+      td->icount = 0;
+      td->syscalls = 0;
+    }
+  gettimeofday(&runStart, NULL);
+  if (edgemap != NULL) memset(edgemap, 0, EDGE_MAP_SIZE);
+  budget = KnobBudget.Value();
+}
+
+/* wall-clock timeout of a forked child or a persistent iteration (-x, in ms; 0 disarms) */
+VOID armTimer(UINT32 ms)
+{
+  struct itimerval it;
+
+  memset(&it, 0, sizeof(it));
+  it.it_value.tv_sec = ms / 1000;
+  it.it_value.tv_usec = (ms % 1000) * 1000;
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+VOID forkServer()
+{
+  UINT32 msg = 0;
+  INT32 status;
+  pid_t pid;
+
+  if (forkStarted) return;
+  forkStarted = TRUE;
+  if (write(FORKSRV_FD + 1, &msg, 4) != 4) return;
+  while (true)
+    {
+      if (read(FORKSRV_FD, &msg, 4) != 4) PIN_ExitProcess(0);
+      pid = fork();
+      if (pid < 0) PIN_ExitProcess(1);
+      if (pid == 0)
+	{
+	  close(FORKSRV_FD);
+	  close(FORKSRV_FD + 1);
+	  resetCounters();
+	  fclose(trace);
+	  trace = fopen(KnobOutputFile.Value().c_str(), "w");
+	  if (KnobTimeout.Value() > 0) armTimer(KnobTimeout.Value());
+	  return;
+	}
+      if (waitpid(pid, &status, 0) < 0) PIN_ExitProcess(1);
+      if (write(FORKSRV_FD + 1, &pid, 4) != 4 || write(FORKSRV_FD + 1, &status, 4) != 4)
+	PIN_ExitProcess(0);
+    }
+}
+
+/*
+ * Persistent mode. The same pipes and replies as the fork server, but
+ * without fork(): the context is saved when -persist_fn is first entered
+ * and, every time the outermost call returns, the counts are written, the
+ * reply is sent (status 0), the next request is awaited and the function
+ * is entered again with PIN_ExecuteAt. Memory is not rewound, so this is
+ * only sound for functions that keep no state between calls. The function
+ * either (re)reads the input from the fixed input file itself or, with
+ * -persist_buf, is given it: on every entry the file of -persist_input is
+ * read into a buffer of -persist_max bytes, and the buffer and length
+ * arguments are set to it. After -persist_iters iterations the process
+ * exits and the fuzzer starts a new one.
+ */
+VOID persistLoad(ADDRINT *bufArg, ADDRINT *lenArg)
+{
+  ssize_t n, len = 0;
+  int fd;
+
+  if (persistBuf == NULL) persistBuf = (char *)malloc(KnobPersistMax.Value() + 1);
+  fd = open(KnobPersistInput.Value().c_str(), O_RDONLY);
+  if (fd < 0 || persistBuf == NULL)
+    {
+      fprintf(stderr, "-persist_buf: can not read %s\n", KnobPersistInput.Value().c_str());
+      PIN_ExitProcess(1);
+    }
+  while (len < (ssize_t)KnobPersistMax.Value() &&
+	 (n = read(fd, persistBuf + len, KnobPersistMax.Value() - len)) > 0)
+    len += n;
+  close(fd);
+  /* for parsers of C strings */
+  persistBuf[len] = '\0';
+  *bufArg = (ADDRINT)persistBuf;
+  if (lenArg != NULL) *lenArg = (ADDRINT)len;
+}
+
+VOID persistEntry(const CONTEXT *ctxt, ADDRINT *bufArg, ADDRINT *lenArg)
+{
+  UINT32 msg = 0;
+
+  if (persistOff || persistDepth++ > 0) return;
+  if (!persistStarted)
+    {
+      persistStarted = TRUE;
+      if (write(FORKSRV_FD + 1, &msg, 4) != 4)
+	{
+	  persistOff = TRUE;
+	  return;
+	}
+      PIN_SaveContext(ctxt, &persistCtx);
+      if (read(FORKSRV_FD, &msg, 4) != 4) PIN_ExitProcess(0);
+    }
+  if (bufArg != NULL) persistLoad(bufArg, lenArg);
+  resetCounters();
+  if (KnobTimeout.Value() > 0) armTimer(KnobTimeout.Value());
+}
+
+VOID persistExit()
+{
+  UINT32 msg = 0;
+  INT32 status = 0;
+  pid_t pid = getpid();
+  FILE *f;
+
+  if (persistOff || persistDepth == 0 || --persistDepth > 0) return;
+  armTimer(0);
+  f = fopen(KnobOutputFile.Value().c_str(), "w");
+  if (f != NULL)
+    {
+      writeCounts(f);
+      fclose(f);
+    }
+  if (weights != NULL) writeFitness();
+  if (seenmap != NULL) writeNew();
+  if (!KnobCost.Value().empty()) writeCost();
+  if (write(FORKSRV_FD + 1, &pid, 4) != 4 || write(FORKSRV_FD + 1, &status, 4) != 4)
+    PIN_ExitProcess(0);
+  if (++persistIter >= KnobPersistIters.Value()) PIN_ExitProcess(0);
+  if (read(FORKSRV_FD, &msg, 4) != 4) PIN_ExitProcess(0);
+  PIN_ExecuteAt(&persistCtx);
+}
+
+VOID instrumentPersist(IMG img)
+{
+  string fn = KnobPersistFn.Value();
+  RTN rtn;
+
+  if (fn.compare(0, 2, "0x") == 0)
+    {
+      ADDRINT addr = (ADDRINT)strtoul(fn.c_str(), NULL, 16);
+      if (addr < IMG_LowAddress(img) || addr > IMG_HighAddress(img)) return;
+      rtn = RTN_FindByAddress(addr);
+    }
+  else
+    rtn = RTN_FindByName(img, fn.c_str());
+  if (!RTN_Valid(rtn)) return;
+  IARGLIST args = IARGLIST_Alloc();
+  if (KnobPersistBuf.Value() >= 0)
+    IARGLIST_AddArguments(args, IARG_FUNCARG_ENTRYPOINT_REFERENCE, KnobPersistBuf.Value(), IARG_END);
+  else
+    IARGLIST_AddArguments(args, IARG_PTR, NULL, IARG_END);
+  if (KnobPersistBuf.Value() >= 0 && KnobPersistLen.Value() >= 0)
+    IARGLIST_AddArguments(args, IARG_FUNCARG_ENTRYPOINT_REFERENCE, KnobPersistLen.Value(), IARG_END);
+  else
+    IARGLIST_AddArguments(args, IARG_PTR, NULL, IARG_END);
+  RTN_Open(rtn);
+  RTN_InsertCall(rtn, IPOINT_BEFORE, AFUNPTR(persistEntry), IARG_CONST_CONTEXT, IARG_IARGLIST, args, IARG_END);
+  RTN_InsertCall(rtn, IPOINT_AFTER, AFUNPTR(persistExit), IARG_END);
+  RTN_Close(rtn);
+  IARGLIST_Free(args);
+}
+
+/* the timeout of a forked child or a persistent iteration; internal threads do not survive fork() */
+BOOL TimeoutSignal(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler, const EXCEPTION_INFO *pExceptInfo, VOID *v)
+{
+  PIN_ExitApplication(TIMEOUT_STATUS);
+  return FALSE;
 }
 
 VOID Trace(TRACE trace, VOID *v)
 {
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
+      /* the budget counts every instruction, monitored or not, so hangs in libraries stop too */
+      if (KnobBudget.Value() > 0)
+	{
+	  BBL_InsertIfCall(bbl, IPOINT_BEFORE, AFUNPTR(budgetTick), IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+	  BBL_InsertThenCall(bbl, IPOINT_BEFORE, AFUNPTR(budgetOver), IARG_END);
+	}
+      if (!KnobCost.Value().empty())
+	BBL_InsertCall(bbl, IPOINT_ANYWHERE, AFUNPTR(countIns), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+      if (forkAddr && !forkStarted)
+	{
+	  for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+	    if (INS_Address(ins) == forkAddr)
+	      INS_InsertCall(ins, IPOINT_BEFORE, AFUNPTR(forkServer), IARG_END);
+	}
+      if (KnobOnce.Value() > 0)
+	{
+	  /* no crash fingerprints or edges here: they need every execution */
+	  if (isMonitoredAddress(BBL_Address(bbl)))
+	    {
+	      UINT32 idx = getIndex(BBL_Address(bbl)), c, off;
+	      chunkOf(idx, &c, &off);
+	      if (countAt(idx) == 0)
+		BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(onceBlock), IARG_REG_VALUE, tdReg, IARG_UINT32, c, IARG_UINT32, off, IARG_ADDRINT, BBL_Address(bbl), IARG_THREAD_ID, IARG_END);
+	    }
+	  continue;
+	}
       if(isMonitoredAddress(BBL_Address(bbl)))
 	{
 	  /* Things related to stack hash/crash fingerprints */
-	  LastExecutedBB[LastExecutedPosBB]= BBL_Address(bbl);
-	  LastExecutedPosBB = (LastExecutedPosBB+1)% LAST_EXECUTED_BB;
+	  UINT32 c, off;
+	  BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(recordBlock), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_ADDRINT, BBL_Address(bbl), IARG_END);
 	  INS tail = BBL_InsTail(bbl);
 	  if( INS_IsCall(tail) )
 	    {
 	      if( INS_IsDirectBranchOrCall(tail))
 		{
 		  ADDRINT target = INS_DirectBranchOrCallTargetAddress(tail);
-		  INS_InsertPredicatedCall(tail, IPOINT_BEFORE, AFUNPTR(call_direct), IARG_ADDRINT, target, IARG_END);
+		  INS_InsertPredicatedCall(tail, IPOINT_BEFORE, AFUNPTR(call_direct), IARG_REG_VALUE, tdReg, IARG_ADDRINT, target, IARG_ADDRINT, INS_NextAddress(tail), IARG_UINT32, idKey(blockId(target)), IARG_END);
 		}
 	      else
 		{
-		  INS_InsertCall(tail, IPOINT_BEFORE, AFUNPTR(call_indirect), IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
+		  INS_InsertCall(tail, IPOINT_BEFORE, AFUNPTR(call_indirect), IARG_REG_VALUE, tdReg, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_ADDRINT, INS_NextAddress(tail), IARG_END);
 		}
 	    }
+	  else if (INS_IsRet(tail))
+	    INS_InsertCall(tail, IPOINT_BEFORE, AFUNPTR(do_return), IARG_REG_VALUE, tdReg, IARG_BRANCH_TARGET_ADDR, IARG_END);
 	  /* stack hask ends here. */
 
-	  BBL_InsertCall(bbl, IPOINT_ANYWHERE, AFUNPTR(rememberBlock), IARG_FAST_ANALYSIS_CALL, IARG_ADDRINT, BBL_Address(bbl), IARG_END);
+	  chunkOf(getIndex(BBL_Address(bbl)), &c, &off);
+	  BBL_InsertCall(bbl, IPOINT_ANYWHERE, AFUNPTR(rememberBlock), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, c, IARG_UINT32, off, IARG_END);
+	  if (edgemap != NULL)
+	    BBL_InsertCall(bbl, IPOINT_ANYWHERE, AFUNPTR(rememberEdge), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, tdReg, IARG_UINT32, edgeId(BBL_Address(bbl)), IARG_END);
 	}
     }
 }
 
 static VOID TimeoutF(VOID * arg)
 {
-  // this function is called in a separate threat to exit the applications after n seconds
+  // this function is called in a separate threat to exit the applications after n miliseconds
   //cout<<"[*] In the thread now..."<<endl;
-  sleep(KnobTimeout.Value());
+  PIN_Sleep(KnobTimeout.Value());
   //cout<<"[*]Going to kill application.."<<endl;
-  PIN_ExitApplication(0);
+  PIN_ExitApplication(TIMEOUT_STATUS);
   /*while(true)
     {
       if (PIN_IsProcessExiting())
@@ -205,17 +1097,12 @@ VOID Fini(INT32 code, VOID *v)
     }
     */
   //if(ret.second == true)
-  map<ADDRINT,unsigned int>::iterator bb;
-  for (bb=bbcount.begin();bb!=bbcount.end();++bb)
-    {
-      fprintf(trace, "%p %u\n", (void *)bb->first, bb->second);
-    //fflush(trace);
-      
-    }
+  writeCounts(trace);
   fclose(trace);
+  if (weights != NULL) writeFitness();
+  if (seenmap != NULL) writeNew();
+  if (!KnobCost.Value().empty()) writeCost();
   fclose(offsets);
-  munmap(offsetmap, 18);
-  close(ioffset);
 }
 
 
@@ -238,23 +1125,6 @@ int main(int argc, char * argv[])
     PIN_InitSymbols();
 
     offsets = fopen("imageOffset.txt", "w");
-    //open file and mmap it to write image load address
-    ioffset = open(FILEPATH, O_RDWR);
-    if (ioffset == -1)
-      {
-	perror("Error opening file for writing");
-	exit(0);
-      }
-    //sz = lseek(ioffset, 0, SEEK_END);
-     //printf("file size %ld\n",(long int)sz);
-     //lseek(ioffset, -sz, SEEK_END);
-     offsetmap = (char*)mmap(0, 18, PROT_READ | PROT_WRITE, MAP_SHARED, ioffset, 0);
-     if (offsetmap == MAP_FAILED) {
-	close(ioffset);
-	printf("Error mmapping the file");
-	//perror("Error mmapping the file");
-	exit(0);
-     }
 
   PIN_THREAD_UID threadUid;
   //THREADID threadId;
@@ -262,6 +1132,40 @@ int main(int argc, char * argv[])
     
   if (PIN_Init(argc, argv)) return Usage();
     trace = fopen(KnobOutputFile.Value().c_str(), "w");
+    budget = KnobBudget.Value();
+    gettimeofday(&runStart, NULL);
+    if (KnobOnce.Value() > 0 && (KnobForkServer.Value() > 0 || !KnobPersistFn.Value().empty()))
+      {
+	/* a reset would need the removed instrumentation back */
+	fprintf(stderr, "-once can not be used with -forkserver or -persist_fn\n");
+	exit(0);
+      }
+    if (KnobPersistBuf.Value() >= 0 && KnobPersistInput.Value().empty())
+      {
+	fprintf(stderr, "-persist_buf needs -persist_input\n");
+	exit(0);
+      }
+    if (!KnobWeights.Value().empty())
+      loadWeights();
+    if (!KnobEdgeMap.Value().empty())
+      {
+	edgemap = mapShared(KnobEdgeMap.Value(), EDGE_MAP_SIZE, "edge map");
+	memset(edgemap, 0, EDGE_MAP_SIZE);
+      }
+    if (!KnobSeen.Value().empty())
+      seenmap = (UINT64 *)mapShared(KnobSeen.Value(), SEEN_SLOTS * sizeof(UINT64), "coverage set");
+    PIN_InitLock(&threadLock);
+    PIN_InitLock(&onceLock);
+    tdKey = PIN_CreateThreadDataKey(0);
+    tdReg = PIN_ClaimToolRegister();
+    if (!REG_valid(tdReg))
+      {
+	fprintf(stderr, "No tool register left for the thread data\n");
+	exit(0);
+      }
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    if (!KnobCost.Value().empty())
+      PIN_AddSyscallEntryFunction(SyscallEntry, 0);
     TRACE_AddInstrumentFunction(Trace, 0);
     /* lets add signal intercept for signal 1, 6, and 11. */
     INT32 signals[3]={1,6,11};
@@ -287,7 +1191,12 @@ int main(int argc, char * argv[])
     //PIN_AddFiniUnlockedFunction(Fini,0); 	
     //sleep(5);
     cout<<"Starting the app now..." << endl;
-	if (KnobTimeout.Value() > 0)
+	if (KnobForkServer.Value() > 0 || !KnobPersistFn.Value().empty())
+	  {
+	    if (KnobTimeout.Value() > 0)
+	      PIN_InterceptSignal(SIGALRM, TimeoutSignal, NULL);
+	  }
+	else if (KnobTimeout.Value() > 0)
     	PIN_SpawnInternalThread(TimeoutF,0,0,&threadUid);
     PIN_StartProgram();
     //cout << "done.." << endl;
@@ -0,0 +1,651 @@
+/*
+ * bbtrap: block coverage at native speed, without Pin.
+ *
+ * The SUT runs under ptrace with a one-shot int3 on the first byte of
+ * every block listed in -blocks (the blocks of the weight tables, see
+ * gautils.writeBlockList). The first hit of a block puts its byte back,
+ * so each block costs one trap per run and everything else runs
+ * natively. The output is what bbcounts2 -once writes: the blocks in its
+ * text format (all counts are 1) and, with -seen, the blocks new to the
+ * session coverage set in -newbb. Blocks the static analysis missed are never
+ * seen.
+ *
+ * Images are looked up in /proc/<pid>/maps once the SUT reaches its entry
+ * point, and numbered as in bbcounts2: 0 is the main executable, 1.. the
+ * -l libraries, then libc with -libc 1. Libraries loaded later with
+ * dlopen() are not covered. Threads and children of the SUT are traced
+ * too; a process that calls execve() is let go.
+ *
+ * With -forkserver 1 the SUT stops at its entry point with all the
+ * breakpoints in place, and a fork() is injected into it for each request
+ * of the fuzzer. The pipes and messages are those of bbcounts2
+ * -forkserver.
+ *
+ * A crash (a fatal signal delivered to the SUT) writes its bucket to
+ * crash.bin, in the format of bbcounts2; the hash is over the signal and
+ * the faulting PC, as an offset in its file, since bbtrap has no call
+ * stack.
+ *
+ * Build: make bbtrap
+ */
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* must match bbcounts2.cpp */
+#define FORKSRV_FD		198
+#define SEEN_SLOTS		(1 << 20)
+#define FNV_PRIME		16777619U
+#define FNV_OFFSET		2166136261U
+#define CRASHFILE		"crash.bin"
+#define TIMEOUT_STATUS		124
+
+#define TRAP_INT3		0xcc
+
+#ifndef PTRACE_O_EXITKILL
+#define PTRACE_O_EXITKILL	(1 << 20)
+#endif
+
+#if defined(__x86_64__)
+#define REG_PC(r)		((r).rip)
+#define REG_SYSNO(r)		((r).rax)
+#define REG_ARG1(r)		((r).rdi)
+#define REG_ARG2(r)		((r).rsi)
+/* syscall; int3 */
+static const uint8_t fork_code[] = { 0x0f, 0x05, TRAP_INT3 };
+#else
+#define REG_PC(r)		((r).eip)
+#define REG_SYSNO(r)		((r).eax)
+#define REG_ARG1(r)		((r).ebx)
+#define REG_ARG2(r)		((r).ecx)
+/* int $0x80; int3 */
+static const uint8_t fork_code[] = { 0xcd, 0x80, TRAP_INT3 };
+#endif
+
+/**** options ******************************************************/
+static const char *blocks_file;
+static const char *out_file = "bbcounts2.out";
+static const char *seen_file;
+static const char *newbb_file = "newbb.out";
+static std::vector<std::string> libnames;
+static unsigned timeout;	/* ms */
+static int libc;
+static int forkserver;
+
+/**** state ********************************************************/
+struct trap_t {
+	uint64_t	id;	/* block ID, as bbcounts2 reports it */
+	uint8_t		orig;	/* the byte under the int3 */
+};
+
+/* image index -> link-time addresses of its blocks */
+static std::map<uint32_t, std::vector<uint32_t> > blocks;
+/* run-time address -> block */
+static std::unordered_map<uintptr_t, trap_t> traps;
+/* blocks hit by the current run, in hit order */
+static std::vector<uint64_t> hits;
+static uint64_t *seenmap;
+static volatile sig_atomic_t timed_out;
+/* the SUT process of the current run, killed by on_alarm() */
+static volatile pid_t run_pid;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/**** tracee memory ************************************************/
+static int mem_access(pid_t pid, uintptr_t addr, void *buf, size_t len,
+		bool wr)
+{
+	char path[32];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+	if ((fd = open(path, wr ? O_RDWR : O_RDONLY)) == -1)
+		return -1;
+	n = wr ? pwrite(fd, buf, len, addr) : pread(fd, buf, len, addr);
+	close(fd);
+	return n == (ssize_t)len ? 0 : -1;
+}
+
+/* the AT_ENTRY of the auxiliary vector of pid */
+static uintptr_t entry_point(pid_t pid)
+{
+	char path[32];
+	ElfW(auxv_t) aux;
+	uintptr_t entry = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/auxv", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	while (fread(&aux, sizeof(aux), 1, f) == 1 && aux.a_type != AT_NULL)
+		if (aux.a_type == AT_ENTRY)
+			entry = aux.a_un.a_val;
+	fclose(f);
+	return entry;
+}
+
+/* lowest page-aligned PT_LOAD address of an ELF file, i.e. its link base */
+static uintptr_t link_base(const char *path)
+{
+	ElfW(Ehdr) eh;
+	ElfW(Phdr) ph;
+	uintptr_t base = (uintptr_t)-1;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	if (fread(&eh, sizeof(eh), 1, f) != 1 ||
+			memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0) {
+		fclose(f);
+		return 0;
+	}
+	for (int i = 0; i < eh.e_phnum; i++) {
+		if (fseek(f, eh.e_phoff + i * eh.e_phentsize, SEEK_SET) != 0 ||
+				fread(&ph, sizeof(ph), 1, f) != 1)
+			break;
+		if (ph.p_type == PT_LOAD && ph.p_vaddr < base)
+			base = ph.p_vaddr;
+	}
+	fclose(f);
+	if (base == (uintptr_t)-1)
+		return 0;
+	return base & ~((uintptr_t)getpagesize() - 1);
+}
+
+/* image index of a mapped file, or -1 if it is not monitored */
+static int image_index(const std::string &path, const std::string &exe)
+{
+	if (path == exe)
+		return 0;
+	for (size_t i = 0; i < libnames.size(); i++)
+		if (path.find(libnames[i]) != std::string::npos)
+			return i + 1;
+	if (libc && path.find("libc.") != std::string::npos)
+		return libnames.size() + 1;
+	return -1;
+}
+
+/*
+ * Puts an int3 on every block of the monitored images of pid. An image is
+ * placed at the lowest mapping of its file; the offset from its link base
+ * is what bbcounts2 gets from IMG_LoadOffset().
+ */
+static void traps_insert(pid_t pid)
+{
+	char path[32], line[4096], exe[4096];
+	std::set<int> done;
+	uint8_t int3 = TRAP_INT3;
+	ssize_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	if ((n = readlink(path, exe, sizeof(exe) - 1)) == -1)
+		die("Error reading the SUT path");
+	exe[n] = '\0';
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		die("Error reading the SUT mappings");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long start;
+		char *file = strchr(line, '/');
+		uintptr_t offset;
+		int index;
+
+		if (file == NULL || sscanf(line, "%lx-", &start) != 1)
+			continue;
+		file[strcspn(file, "\n")] = '\0';
+		index = image_index(file, exe);
+		if (index < 0 || !done.insert(index).second)
+			continue;
+		offset = start - link_base(file);
+		std::vector<uint32_t> &adrs = blocks[index];
+		for (size_t i = 0; i < adrs.size(); i++) {
+			uintptr_t addr = adrs[i] + offset;
+			trap_t trap;
+
+			trap.id = ((uint64_t)index << 32) | adrs[i];
+			if (traps.count(addr) ||
+					mem_access(pid, addr, &trap.orig, 1, false) != 0 ||
+					mem_access(pid, addr, &int3, 1, true) != 0)
+				continue;
+			traps[addr] = trap;
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * If tid stopped on one of our traps, puts the byte back, steps back over
+ * the int3 and records the block.
+ */
+static bool trap_hit(pid_t tid)
+{
+	struct user_regs_struct regs;
+	std::unordered_map<uintptr_t, trap_t>::iterator it;
+
+	if (ptrace(PTRACE_GETREGS, tid, 0, &regs) == -1)
+		return false;
+	it = traps.find(REG_PC(regs) - 1);
+	if (it == traps.end() ||
+			mem_access(tid, it->first, &it->second.orig, 1, true) != 0)
+		return false;
+	REG_PC(regs) = it->first;
+	if (ptrace(PTRACE_SETREGS, tid, 0, &regs) == -1)
+		return false;
+	hits.push_back(it->second.id);
+	return true;
+}
+
+/**** crashes ******************************************************/
+static bool crash_signal(int sig)
+{
+	return sig == SIGSEGV || sig == SIGBUS || sig == SIGILL ||
+		sig == SIGFPE || sig == SIGABRT;
+}
+
+/* writes the bucket of a crash of tid, "signal:hash" like bbcounts2 */
+static void write_crash(pid_t tid, int sig)
+{
+	struct user_regs_struct regs;
+	char path[32], line[4096];
+	uintptr_t pc;
+	uint32_t h = FNV_OFFSET;
+	FILE *f;
+
+	if (ptrace(PTRACE_GETREGS, tid, 0, &regs) == -1)
+		return;
+	pc = REG_PC(regs);
+	h = (h ^ (uint32_t)sig) * FNV_PRIME;
+	snprintf(path, sizeof(path), "/proc/%d/maps", tid);
+	if ((f = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			unsigned long start, end, offset;
+			char *file = strrchr(line, '/');
+
+			if (sscanf(line, "%lx-%lx %*s %lx", &start, &end,
+						&offset) != 3 ||
+					pc < start || pc >= end)
+				continue;
+			/* the same in every run, whatever the load address */
+			pc = pc - start + offset;
+			for (; file != NULL && *file != '\0' && *file != '\n'; file++)
+				h = (h ^ (uint8_t)*file) * FNV_PRIME;
+			break;
+		}
+		fclose(f);
+	}
+	h = (h ^ (uint32_t)pc) * FNV_PRIME;
+	if ((f = fopen(CRASHFILE, "w")) == NULL)
+		return;
+	fprintf(f, "%d:%08x\n", sig, h);
+	fclose(f);
+}
+
+/**** running ******************************************************/
+/*
+ * The timeout. The SUT is killed from here, as the timer may fire while
+ * the tracer is busy (trap_hit(), ptrace()) instead of in waitpid().
+ */
+static void on_alarm(int sig)
+{
+	timed_out = 1;
+	if (run_pid > 0)
+		kill(run_pid, SIGKILL);
+}
+
+static void arm_timer(unsigned ms)
+{
+	struct itimerval it;
+
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = ms / 1000;
+	it.it_value.tv_usec = (ms % 1000) * 1000;
+	setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * Runs pid (stopped, traced) and the threads and processes it starts
+ * until pid is gone, then kills what is left. Returns the wait status of
+ * pid; after -x ms, that of an exit with TIMEOUT_STATUS, like bbcounts2.
+ */
+static int trace_run(pid_t pid)
+{
+	std::set<pid_t> live;
+	int status, result = 0;
+	unsigned long msg;
+	pid_t tid;
+
+	hits.clear();
+	timed_out = 0;
+	run_pid = pid;
+	live.insert(pid);
+	if (timeout > 0)
+		arm_timer(timeout);
+	ptrace(PTRACE_CONT, pid, 0, 0);
+	while (live.count(pid)) {
+		if ((tid = waitpid(-1, &status, __WALL)) == -1) {
+			if (errno != EINTR)
+				break;
+			if (timed_out)
+				kill(pid, SIGKILL);
+			continue;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			live.erase(tid);
+			if (tid == pid) {
+				run_pid = 0;
+				result = timed_out ? TIMEOUT_STATUS << 8 : status;
+			}
+			continue;
+		}
+		if (!WIFSTOPPED(status))
+			continue;
+		switch (status >> 16) {
+		case PTRACE_EVENT_FORK:
+		case PTRACE_EVENT_VFORK:
+		case PTRACE_EVENT_CLONE:
+			ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg);
+			live.insert(msg);
+			ptrace(PTRACE_CONT, tid, 0, 0);
+			continue;
+		case PTRACE_EVENT_EXEC:
+			/* our traps mean nothing to the new program */
+			live.erase(tid);
+			ptrace(PTRACE_DETACH, tid, 0, 0);
+			continue;
+		case 0:
+			break;
+		default:
+			ptrace(PTRACE_CONT, tid, 0, 0);
+			continue;
+		}
+		if (WSTOPSIG(status) == SIGSTOP && !live.count(tid)) {
+			/* first stop of a new tracee, before its parent's event */
+			live.insert(tid);
+			ptrace(PTRACE_CONT, tid, 0, 0);
+		} else if (WSTOPSIG(status) == SIGTRAP && trap_hit(tid))
+			ptrace(PTRACE_CONT, tid, 0, 0);
+		else {
+			if (crash_signal(WSTOPSIG(status)))
+				write_crash(tid, WSTOPSIG(status));
+			ptrace(PTRACE_CONT, tid, 0, WSTOPSIG(status));
+		}
+	}
+	run_pid = 0;
+	arm_timer(0);
+	/* not waitpid(-1): the fork server itself stays stopped */
+	for (std::set<pid_t>::iterator it = live.begin(); it != live.end(); ++it) {
+		kill(*it, SIGKILL);
+		while (waitpid(*it, &status, __WALL) > 0 &&
+				!WIFEXITED(status) && !WIFSIGNALED(status))
+			;
+	}
+	return result;
+}
+
+/*
+ * Starts the SUT traced and runs it to its entry point, where all the
+ * traps are put in. Returns it stopped there.
+ */
+static pid_t trace_start(char **argv)
+{
+	struct user_regs_struct regs;
+	uint8_t orig, int3 = TRAP_INT3;
+	uintptr_t entry;
+	int status;
+	pid_t pid;
+
+	if ((pid = fork()) == -1)
+		die("Error forking the SUT");
+	if (pid == 0) {
+		close(FORKSRV_FD);
+		close(FORKSRV_FD + 1);
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+		fprintf(stderr, "Error starting %s\n", argv[0]);
+		exit(1);
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACEFORK |
+			PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+			PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+	if ((entry = entry_point(pid)) == 0 ||
+			mem_access(pid, entry, &orig, 1, false) != 0 ||
+			mem_access(pid, entry, &int3, 1, true) != 0)
+		die("Error setting a breakpoint at the entry point");
+	ptrace(PTRACE_CONT, pid, 0, 0);
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status) ||
+			WSTOPSIG(status) != SIGTRAP) {
+		fprintf(stderr, "%s did not reach its entry point\n", argv[0]);
+		exit(1);
+	}
+	mem_access(pid, entry, &orig, 1, true);
+	ptrace(PTRACE_GETREGS, pid, 0, &regs);
+	REG_PC(regs) = entry;
+	ptrace(PTRACE_SETREGS, pid, 0, &regs);
+	traps_insert(pid);
+	return pid;
+}
+
+/*
+ * Makes tmpl (stopped at its entry point) fork, and returns the child
+ * stopped at the same point. Both get their code and registers back. The
+ * fork is a clone(CLONE_PARENT) so that the child is ours to reap: tmpl
+ * never runs to wait for it.
+ */
+static pid_t inject_fork(pid_t tmpl)
+{
+	struct user_regs_struct saved, regs;
+	uint8_t code[sizeof(fork_code)];
+	unsigned long child;
+	uintptr_t pc;
+	int status;
+
+	if (ptrace(PTRACE_GETREGS, tmpl, 0, &saved) == -1)
+		die("Error reading the fork server registers");
+	pc = REG_PC(saved);
+	if (mem_access(tmpl, pc, code, sizeof(code), false) != 0 ||
+			mem_access(tmpl, pc, (void *)fork_code, sizeof(code), true) != 0)
+		die("Error injecting fork()");
+	regs = saved;
+	REG_SYSNO(regs) = SYS_clone;
+	REG_ARG1(regs) = CLONE_PARENT | SIGCHLD;
+	REG_ARG2(regs) = 0;	/* same stack, copied */
+	ptrace(PTRACE_SETREGS, tmpl, 0, &regs);
+	ptrace(PTRACE_CONT, tmpl, 0, 0);
+	if (waitpid(tmpl, &status, __WALL) == -1 ||
+			(status >> 16) != PTRACE_EVENT_FORK)
+		die("Error waiting for the injected fork()");
+	ptrace(PTRACE_GETEVENTMSG, tmpl, 0, &child);
+	/* run to the int3 after the syscall */
+	ptrace(PTRACE_CONT, tmpl, 0, 0);
+	waitpid(tmpl, &status, __WALL);
+	mem_access(tmpl, pc, code, sizeof(code), true);
+	ptrace(PTRACE_SETREGS, tmpl, 0, &saved);
+	waitpid(child, &status, __WALL);
+	mem_access(child, pc, code, sizeof(code), true);
+	ptrace(PTRACE_SETREGS, child, 0, &saved);
+	return child;
+}
+
+/**** output *******************************************************/
+/* add a block to the -seen set, as idSetAdd() of bbcounts2; true if new */
+static bool seen_add(uint64_t id)
+{
+	uint32_t key = (uint32_t)id ^ ((uint32_t)(id >> 32) * FNV_PRIME);
+	uint32_t h = key * 0x9e3779b1U;
+
+	h ^= h >> 16;
+	for (uint32_t i = 0; i < SEEN_SLOTS; i++) {
+		uint64_t *slot = &seenmap[(h + i) & (SEEN_SLOTS - 1)];
+
+		if (*slot == id)
+			return false;
+		if (*slot == 0) {
+			*slot = id;
+			return true;
+		}
+	}
+	return true;
+}
+
+static void write_output(void)
+{
+	std::vector<uint64_t> fresh;
+	FILE *f;
+
+	std::sort(hits.begin(), hits.end());
+	hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+	if ((f = fopen(out_file, "w")) == NULL)
+		die("Error writing output");
+	for (size_t i = 0; i < hits.size(); i++)
+		fprintf(f, "0x%llx 1\n", (unsigned long long)hits[i]);
+	fclose(f);
+	if (seenmap == NULL)
+		return;
+	for (size_t i = 0; i < hits.size(); i++)
+		if (seen_add(hits[i]))
+			fresh.push_back(hits[i]);
+	if ((f = fopen(newbb_file, "w")) == NULL)
+		return;
+	fprintf(f, "%u\n", (unsigned)fresh.size());
+	for (size_t i = 0; i < fresh.size(); i++)
+		fprintf(f, "0x%llx ", (unsigned long long)fresh[i]);
+	fprintf(f, "\n");
+	fclose(f);
+}
+
+/**** setup ********************************************************/
+/* one block ID (gautils.bbKey) per line */
+static void read_blocks(const char *path)
+{
+	unsigned long long id;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		die("Error opening the block list");
+	while (fscanf(f, "%llx", &id) == 1)
+		blocks[id >> 32].push_back((uint32_t)id);
+	fclose(f);
+}
+
+static uint64_t *map_seen(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	void *map;
+
+	if (fd == -1 || ftruncate(fd, SEEN_SLOTS * sizeof(uint64_t)) == -1)
+		die("Error opening coverage set");
+	map = mmap(0, SEEN_SLOTS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		die("Error mmapping coverage set");
+	return (uint64_t *)map;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: bbtrap -blocks <file> [-o <out>] [-x <ms>] "
+			"[-l <libs>] [-libc 0|1] [-seen <map>] [-newbb <out>] "
+			"[-forkserver 0|1] [-once 0|1] -- <SUT> [args]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	uint32_t msg = 0;
+	int i, status;
+	pid_t pid;
+
+	for (i = 1; i + 1 < argc && strcmp(argv[i], "--") != 0; i += 2) {
+		const char *opt = argv[i], *val = argv[i + 1];
+
+		if (!strcmp(opt, "-blocks"))
+			blocks_file = val;
+		else if (!strcmp(opt, "-o"))
+			out_file = val;
+		else if (!strcmp(opt, "-x"))
+			timeout = atoi(val);
+		else if (!strcmp(opt, "-l")) {
+			std::string libs(val);
+			size_t pos;
+
+			while (!libs.empty()) {
+				pos = libs.find(',');
+				libnames.push_back(libs.substr(0, pos));
+				libs = pos == std::string::npos ? "" : libs.substr(pos + 1);
+			}
+		} else if (!strcmp(opt, "-libc"))
+			libc = atoi(val);
+		else if (!strcmp(opt, "-seen"))
+			seen_file = val;
+		else if (!strcmp(opt, "-newbb"))
+			newbb_file = val;
+		else if (!strcmp(opt, "-forkserver"))
+			forkserver = atoi(val);
+		else if (strcmp(opt, "-once") != 0)	/* every run is -once */
+			usage();
+	}
+	if (i + 1 >= argc || blocks_file == NULL)
+		usage();
+	read_blocks(blocks_file);
+	if (seen_file != NULL)
+		seenmap = map_seen(seen_file);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_alarm;
+	sigaction(SIGALRM, &sa, NULL);	/* no SA_RESTART: interrupt waitpid() */
+
+	pid = trace_start(argv + i + 1);
+	/* if nobody reads the hello, run the SUT once, as bbcounts2 does */
+	if (!forkserver || write(FORKSRV_FD + 1, &msg, 4) != 4) {
+		status = trace_run(pid);
+		write_output();
+		if (WIFEXITED(status))
+			return WEXITSTATUS(status);
+		/* die the same way, so the fuzzer sees the crash */
+		signal(WTERMSIG(status), SIG_DFL);
+		kill(getpid(), WTERMSIG(status));
+		return 128 + WTERMSIG(status);
+	}
+	while (read(FORKSRV_FD, &msg, 4) == 4) {
+		int32_t reply[2];
+
+		reply[0] = inject_fork(pid);
+		reply[1] = trace_run(reply[0]);
+		write_output();
+		/* one write, so the fuzzer reads pid and status at once */
+		if (write(FORKSRV_FD + 1, reply, sizeof(reply)) != sizeof(reply))
+			break;
+	}
+	kill(pid, SIGKILL);
+	return 0;
+}
@@ -11,8 +11,7 @@ mydir = os.path.dirname(os.path.abspath(inspect.getfile(inspect.currentframe()))
 ######################
 #for PIN trace to work, run the following from the shell you will run your fuzzer:
 # echo 0 | sudo tee /proc/sys/kernel/yama/ptrace_scope
-# Also disable ASLR:
-# echo 0 | sudo tee /proc/sys/kernel/randomize_va_space
+# ASLR can stay on: bbcounts2 identifies BBs by binary and offset (see gautils.bbKey).
 ##################
 
 # set path to Pin home where pin is found 
@@ -28,7 +27,7 @@ PINTNT=mydir+"/obj-ia32/dtracker.so"
 # set file path to read executed BBs and their respective frequencies
 BBOUT=mydir + "/outd/bbc.out"
 
-# Set file path for crash hash info (this cannot be changed as pintool writes to this file)
+# Set file path for crash bucket info, i.e. "signal:hash" (this cannot be changed as pintool writes to this file)
 CRASHFILE='crash.bin'
 
 ############################## argument setting  #######################
@@ -51,7 +50,7 @@ LIBPICKLE=[]
 NAMESPICKLE=[]
 
 
-#set load offsets of the libraries of interest by observing pintool output for image load. You get this value by fisrt launching the application as trial and then reading the file imageOffset.txt.  
+#not used anymore: BBs are identified by binary and offset, so load offsets do not matter. bbcounts2 still lists the monitored binaries and their load offsets in imageOffset.txt.
 LIBOFFSETS=[]
 ##################################################
 
@@ -85,9 +84,69 @@ IMAGELOAD="imageOffset.txt"
 
 # this is the main command that is passed to run() function in runfuzzer.py
 
-PINCMD=[PINHOME,"-tool_exit_timeout", "1","-t", PINTOOL,"-o", BBOUT,"-x", "0","-libc","0","-l",LIBTOMONITOR,"--"]
+# a run that executes more than INSBUDGET instructions (0: no limit), or takes longer than TIMEOUT miliseconds (0: no limit), is stopped by bbcounts2 with exit code TIMEOUTCODE. The instruction budget makes hangs cost the same bounded time on every run; the wall-clock timeout is a fallback (e.g. for a SUT blocked in a syscall).
+INSBUDGET=200000000
+TIMEOUT=30000
+TIMEOUTCODE=124
+
+PINCMD=[PINHOME,"-tool_exit_timeout", "1","-t", PINTOOL,"-o", BBOUT,"-x", str(TIMEOUT),"-budget", str(INSBUDGET),"-libc","0","-l",LIBTOMONITOR,"--"]
+
+# set this to run bbcounts2 as a fork server: Pin and the SUT are started once and a child is forked for each input. Inputs are copied to FSINPUT (plus their extension) before each run, as the SUT command line is fixed.
+FORKSERVER=False
+FSINPUT=mydir + "/outd/fsinput"
+# set this to the name (or 0x address) of a stateless parsing function to run bbcounts2 in persistent mode: the function is called again for each input, without restarting or forking the SUT. The function must read its input from FSINPUT itself, unless PERSISTBUF is set. A new process is started every PERSISTITERS inputs.
+PERSISTFN=''
+PERSISTITERS=1000
+# for a PERSISTFN that parses a buffer: the index of its buffer argument and of its length argument (-1: none, e.g. for a C string). Each input is then copied to a buffer of PERSISTMAX bytes (longer inputs are cut) that is passed in these arguments.
+PERSISTBUF=-1
+PERSISTLEN=-1
+PERSISTMAX=1048576
+# set this to a file path (e.g. "/dev/shm/vuzzer-edges") to also record edge coverage in a 64 KB hitmap shared with bbcounts2. Inputs that take a new edge, or an edge a new number of times (AFL-style classes), are treated like inputs that find a new BB.
+EDGEMAP=''
+# set this to let bbcounts2 write BBOUT as sorted binary (BB, log2 bucket) arrays (-binout 1) instead of text; much cheaper to write and parse.
+BBBINARY=False
+# set this to let bbcounts2 compute the fitness itself (same as gautils.fitnesCal2) from a weight table written at start (WEIGHTFILE) and the error BBs (ERRORBBFILE). The fuzzer then reads a few numbers (FITOUT) per input instead of all BBs. Used only when BBWEIGHT is True.
+TOOLFITNESS=False
+WEIGHTFILE=mydir + "/outd/bbweights.bin"
+ERRORBBFILE=mydir + "/outd/errorbb.lst"
+FITOUT=mydir + "/outd/fitness.out"
+LASTFIT=None # sums of the last execution, see runfuzzer.read_fitness()
+# set this to a file path to let bbcounts2 keep a global coverage set (an exact table of BB IDs, 8 MB) for the whole fuzzing session (-seen). Each run then reports the BBs it found first (NEWBBOUT), and such inputs are preferred for taint analysis (NOVELIN, TAINTCOV). The special inputs and the per-generation coverage still come from the diff against SEENBB.
+SEENMAP=''
+NEWBBOUT=mydir + "/outd/newbb.out"
+LASTNEW=None # BBs found first by the last execution, see runfuzzer.read_newbb()
+NOVELIN=set() # inputs of this generation that found globally new BBs
+# set file path where bbcounts2 writes the cost of each run (-cost): executed BBs, instructions, syscalls, peak RSS (KB) and wall time (ms). Set to '' to turn it off.
+COSTOUT=mydir + "/outd/cost.out"
+LASTCOST=None # cost of the last execution, see runfuzzer.read_cost()
+COSTMAP=dict() # cost of each input of the current generation. key=file name, value=LASTCOST
+
+# set this to run bbcounts2 with -once where only the set of executed BBs is needed (dry run, error BB detection): the instrumentation of a BB is removed after its first execution, so such runs are close to native speed. Not used with FORKSERVER or PERSISTFN.
+COVONCE=True
+# set this to let dtracker (PINTNTCMD) also count BBs, so an input that finds globally new BBs (needs SEENMAP) gets its taint from the same run: taint is propagated from the open of the input on, but compares and LEAs are only logged from the first new BB on, so those executed before it are missing from the taint of that input. Turns off FORKSERVER, PERSISTFN, TOOLFITNESS and BBBINARY.
+TAINTCOV=False
+# set this to run the SUT under bbtrap (make bbtrap) instead of Pin: every BB of the weight tables gets a one-shot breakpoint, so only BB reachability is recorded (all counts are 1), at close to native speed. BBs missed by the static analysis are not seen. Crashes are bucketed by signal and faulting PC only (no call stack). Best used with FORKSERVER. Turns off PERSISTFN, TOOLFITNESS, BBBINARY, EDGEMAP, COSTOUT and TAINTCOV.
+TRAPCOV=False
+BBTRAP=mydir + "/bbtrap"
+BLOCKLIST=mydir + "/outd/blocks.lst"
 
 PINTNTCMD=[PINHOME,"-follow_execv","-t", PINTNT,"-filename", "inputf","-stdout","0","--"]
+# set this to run dtracker as a fork server for taint analysis: Pin, libdft and the SUT run once up to the first open() of the input, and a child is forked from there for each input. Inputs are copied to TNTINPUT (plus their extension) before each run. The SUT must open its input by the path on its command line.
+TAINTFORKSERVER=False
+TNTINPUT=mydir + "/outd/tntinput"
+# with TAINTFORKSERVER, set this to a file path (e.g. "/dev/shm/vuzzer-input") to fork dtracker at the first read() of the input rather than at its open(), and to pass each input in this shared file instead of TNTINPUT. The SUT must read its input sequentially with read() (no mmap, no size from fstat). Inputs are cut to SHMINMAX bytes.
+SHMINPUT=''
+SHMINMAX=1<<20
+
+# set this to a number of threads to let dtracker (PINTNTCMD) replay the taint propagation of the SUT on them (-replay): the SUT only logs the operands of the propagation handlers, which is cheaper than running them, and the cmp/lea output is the same. Needs spare cores. Not used with TAINTFORKSERVER.
+TAINTREPLAY=0
+# set this to let dtracker detach from the SUT once the input is closed and no taint is left (-autodetach), so output work after parsing runs natively. Not used with TAINTCOV or TAINTREPLAY.
+TAINTDETACH=False
+# set this to a number of cmp.out records after which dtracker stops and detaches (-maxcmp). 0: no limit.
+MAXCMP=0
+
+# set this to pass inputs to the SUT (and the fork servers) in a memfd, as /proc/self/fd/N, instead of by their file path: no file is written per execution, and dtracker recognizes the input by identity (-inputfd) instead of by name. The SUT must not depend on the name or extension of its input file.
+MEMFDINPUT=False
 
 # IntelPT related CMD
 SIMPLEPTDIR=mydir + '/../simple-pt/'
@@ -125,6 +184,8 @@ cPERGENBB=set()
 
 # a set to record seen BBs across previous iterations
 SEENBB=set()
+SEENEDGE=set() # same for (edge, hit count class) pairs, see EDGEMAP
+LASTEDGES=set() # (edge, hit count class) pairs of the last execution
 TMPBBINFO=dict()
 PREVBBINFO=dict() #this keeps special entries for the previous generation. It is used to delete inputs which are superceded by newer inputs in dicovering new BBs.
 
@@ -199,6 +260,7 @@ PRINTCACHESTATS=True
 # this is a dictionary to keep per input taintinfo. key=file_name, value=tuple(set(all offsets used in some CMP),dict(key=offset; value=list(concrete values of immediates in CMP)))
 TAINTMAP=dict()
 LEAMAP=dict() # dictionary to keep offsets for a input that were used in LEA instructions.
+PATCHMAP=dict() # dictionary to keep input-to-state patches (from patch.out) for a input. value=list of [(offset,byte),...]
 
 #this is the limit of tainted file lines that we'll read. this is to avoid reading huge files.
 MAXFILELINE=200000
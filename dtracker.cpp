@@ -4,17 +4,22 @@
 #include <fstream>
 #include <set>
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /* DataTracker includes. */
 #include "provlog.H"
 #include "dtracker.H"
 #include "hooks/hooks.H"
 #include "osutils.H"
+#include "dtracker_cov.H"
 
 /* libdft includes. */
 #include "tagmap.h"
+#include "libdft_replay.h"
 
 /* Pin includes. */
 #include <pin.H>
@@ -24,6 +29,9 @@
 
 /* Syscall descriptors, defined in libdft. */
 
+/* fork server pipes, as in bbcounts2: requests are read from FORKSRV_FD, replies go to FORKSRV_FD+1 */
+#define FORKSRV_FD 198
+
 /* Bool variable for mmap type */
 bool mmap_type;
 
@@ -32,6 +40,10 @@ static KNOB<string> ProvRawKnob(KNOB_MODE_WRITEONCE, "pintool", "l",
 	"rawprov.out", "The output file for raw prov data"
 );
 
+static KNOB<string> ProvBinKnob(KNOB_MODE_WRITEONCE, "pintool", "provbin",
+	"0", "Write the raw prov data in the binary format (see provbin2raw.py)"
+);
+
 static KNOB<string> ReadRawKnob(KNOB_MODE_WRITEONCE, "pintool", "read.out",
         "1", "Taint data originating from read"
 );
@@ -48,6 +60,10 @@ static KNOB<string> FileKnob(KNOB_MODE_WRITEONCE, "pintool", "filename",
         "osutils.H", "Filename for which we need to track taint"
 );
 
+static KNOB<string> InputFdKnob(KNOB_MODE_WRITEONCE, "pintool", "inputfd",
+        "-1", "Inherited fd of the input (e.g. a memfd); files are matched by identity with it instead of by -filename"
+);
+
 static KNOB<string> MmapKnob(KNOB_MODE_WRITEONCE, "pintool", "mmap",
         "1", "Method of mmap which we want to spread taint"
 );
@@ -60,6 +76,59 @@ static KNOB<string> LeaRawKnob(KNOB_MODE_WRITEONCE, "pintool", "lea.out",
         "1", "The output file for lea"
 );
 
+static KNOB<string> TokenRawKnob(KNOB_MODE_WRITEONCE, "pintool", "token.out",
+        "1", "The output file for byte-wise compare tokens"
+);
+
+static KNOB<string> SizeTokenKnob(KNOB_MODE_WRITEONCE, "pintool", "mintoken",
+        "2", "Minimum length of a byte-wise compare token"
+);
+
+static KNOB<string> PatchRawKnob(KNOB_MODE_WRITEONCE, "pintool", "patch.out",
+        "1", "The output file for input-to-state compare patches"
+);
+
+static KNOB<string> ForkServerKnob(KNOB_MODE_WRITEONCE, "pintool", "forkserver",
+        "0", "Serve fuzzer requests from the first open() of -filename, forking a child for each"
+);
+
+static KNOB<string> ShmInputKnob(KNOB_MODE_WRITEONCE, "pintool", "shminput",
+        "", "Fork server that forks at the first read() of -filename and reads the input from this shared file instead (4-byte length, then the data)"
+);
+
+static KNOB<string> ReplayKnob(KNOB_MODE_WRITEONCE, "pintool", "replay",
+        "0", "Log the taint propagation of the program and replay it on this many internal threads (see libdft_replay.h); not with -forkserver/-shminput"
+);
+
+static KNOB<string> AutoDetachKnob(KNOB_MODE_WRITEONCE, "pintool", "autodetach",
+        "0", "Detach once the input files are closed and no tag is live; not with -bbout"
+);
+
+static KNOB<string> MaxCmpKnob(KNOB_MODE_WRITEONCE, "pintool", "maxcmp",
+        "0", "Write at most this many cmp.out records, then detach (not with -bbout); 0: no limit"
+);
+
+/* Pin knobs for block coverage, see dtracker_cov.H */
+static KNOB<string> BBOutKnob(KNOB_MODE_WRITEONCE, "pintool", "bbout",
+        "", "Also write block counts (bbcounts2 text format) to this file"
+);
+
+static KNOB<string> BBLibsKnob(KNOB_MODE_WRITEONCE, "pintool", "bblibs",
+        "", "Libraries whose blocks are counted too, separated by comma"
+);
+
+static KNOB<string> TaintModeKnob(KNOB_MODE_WRITEONCE, "pintool", "taint",
+        "1", "0: coverage only, 1: taint from the start, 2: taint from the input open, cmp/lea records from the first block not in -seen"
+);
+
+static KNOB<string> SeenKnob(KNOB_MODE_WRITEONCE, "pintool", "seen",
+        "", "Global coverage set of bbcounts2"
+);
+
+static KNOB<string> NewBBKnob(KNOB_MODE_WRITEONCE, "pintool", "newbb",
+        "newbb.out", "The output file for blocks new to -seen"
+);
+
 /* Pin knobs for tracking stdin/stdout/stderr */
 static KNOB<string> TrackStdin(KNOB_MODE_WRITEONCE, "pintool", "stdin",
 	"0", "Taint data originating from stdin."
@@ -88,6 +157,37 @@ VOID contextDbg( const CONTEXT *ctxt )
 }
 #include "syscall_desc.h"
 extern syscall_desc_t syscall_desc[SYSCALL_MAX];
+
+/*
+ * Logs the exec of the program and adds stdin/stdout/stderr to the
+ * watched file descriptors, as requested by the knobs.
+ */
+static void WatchStdFds(void) {
+	PROVLOG::exec(exename, pid);
+
+	if ( atoi(TrackStdin.Value().c_str()) ) {
+		PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDIN_FILENO];
+		std::string fdn = fdname(STDIN_FILENO);
+		fdset.insert(STDIN_FILENO);
+		LOG( "Watching fd" + decstr(STDIN_FILENO) + " (" + fdn + ").\n");
+		PROVLOG::open(ufd, fdn, fcntl(STDIN_FILENO, F_GETFL), 0);
+	}
+	if ( atoi(TrackStdout.Value().c_str()) ) {
+		PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDOUT_FILENO];
+		std::string fdn = fdname(STDOUT_FILENO);
+		fdset.insert(STDOUT_FILENO);
+		LOG( "Watching fd" + decstr(STDOUT_FILENO) + " (" + fdn + ").\n");
+		PROVLOG::open(ufd, fdn, fcntl(STDOUT_FILENO, F_GETFL), 0);
+	}	
+	if ( atoi(TrackStderr.Value().c_str()) ) {
+		PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDERR_FILENO];
+		std::string fdn = fdname(STDERR_FILENO);
+		fdset.insert(STDERR_FILENO);
+		LOG( "Watching fd" + decstr(STDERR_FILENO) + " (" + fdn + ").\n");
+		PROVLOG::open(ufd, fdn, fcntl(STDERR_FILENO, F_GETFL), 0);
+	}
+}
+
 /*
  * Called when a new image is loaded.
  * Currently only acts when the main executable is loaded to set exename global.
@@ -96,32 +196,11 @@ static void ImageLoad(IMG img, VOID * v) {
 	if (IMG_IsMainExecutable(img)) {
 		exename = path_resolve(IMG_Name(img));
 		pid = getpid();
-		PROVLOG::exec(exename, pid);
 
 		// Add stdin/stdout/stderr to watched file descriptors.
 		// This should take place while loading the image in order to have 
 		// exename available.
-		if ( atoi(TrackStdin.Value().c_str()) ) {
-			PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDIN_FILENO];
-			std::string fdn = fdname(STDIN_FILENO);
-			fdset.insert(STDIN_FILENO);
-			LOG( "Watching fd" + decstr(STDIN_FILENO) + " (" + fdn + ").\n");
-			PROVLOG::open(ufd, fdn, fcntl(STDIN_FILENO, F_GETFL), 0);
-		}
-		if ( atoi(TrackStdout.Value().c_str()) ) {
-			PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDOUT_FILENO];
-			std::string fdn = fdname(STDOUT_FILENO);
-			fdset.insert(STDOUT_FILENO);
-			LOG( "Watching fd" + decstr(STDOUT_FILENO) + " (" + fdn + ").\n");
-			PROVLOG::open(ufd, fdn, fcntl(STDOUT_FILENO, F_GETFL), 0);
-		}	
-		if ( atoi(TrackStderr.Value().c_str()) ) {
-			PROVLOG::ufd_t ufd = PROVLOG::ufdmap[STDERR_FILENO];
-			std::string fdn = fdname(STDERR_FILENO);
-			fdset.insert(STDERR_FILENO);
-			LOG( "Watching fd" + decstr(STDERR_FILENO) + " (" + fdn + ").\n");
-			PROVLOG::open(ufd, fdn, fcntl(STDERR_FILENO, F_GETFL), 0);
-		}
+		WatchStdFds();
 
 		// TODO: Do we need to wash taint at this point?
 	}
@@ -132,8 +211,11 @@ static void ImageLoad(IMG img, VOID * v) {
 /* read stringstream */
 std::ofstream read_offset;
 std::ofstream lea_offset;
+std::ofstream token_offset;
+std::ofstream patch_offset;
 extern int limit_offset;
 extern int limit_lea;
+extern int limit_token;
 /*output file for read */
 //ofstream ReadFile;
 
@@ -142,6 +224,168 @@ extern int limit_lea;
 
 
 
+/*
+ * (Re)opens the output files, truncating them.
+ */
+static void OpenOutputs(void) {
+	PROVLOG::rawProvStream.close();
+	if (atoi(ProvBinKnob.Value().c_str())) {
+		PROVLOG::rawProvStream.open(ProvRawKnob.Value().c_str(), std::ios::binary | std::ios::trunc | std::ios::out);
+		PROVLOG::bin_begin();
+	}
+	else
+		PROVLOG::rawProvStream.open(ProvRawKnob.Value().c_str());
+	out.close();
+	out.open(CmpRawKnob.Value().c_str(), std::ios::binary | std::ios::trunc | std::ios::out );
+	if (atoi(ReadRawKnob.Value().c_str()) ) {
+		read_offset.close();
+		read_offset.open("read.out");
+	}
+	if (atoi(LeaRawKnob.Value().c_str()) ) {
+		lea_offset.close();
+		lea_offset.open("lea.out");
+	}
+	if (atoi(TokenRawKnob.Value().c_str()) ) {
+		token_offset.close();
+		token_offset.open("token.out");
+	}
+	if (atoi(PatchRawKnob.Value().c_str()) ) {
+		patch_offset.close();
+		patch_offset.open("patch.out");
+	}
+}
+
+/*
+ * Input substitution (-shminput). The fuzzer writes every input to a
+ * shared file: its length (4 bytes), then the data. In a forked child,
+ * the reads of a watched fd return the bytes at the same offset of that
+ * input instead of the file contents, and the fd offset is moved so that
+ * lseek() and the read hook see the position in the input. Only read(2)
+ * is redirected: the input file has to be read sequentially, without
+ * mmap(), pread() or sizes taken from fstat().
+ */
+#define SHMIN_HDR 4
+static UINT8 *shmInput = NULL;
+static size_t shmInputMax = 0;
+static bool shmActive = false;
+
+static int MapShmInput(const std::string &path) {
+	struct stat st;
+	int fd = open(path.c_str(), O_RDONLY);
+	void *map;
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size <= SHMIN_HDR) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	shmInput = (UINT8 *)map;
+	shmInputMax = st.st_size - SHMIN_HDR;
+	return 0;
+}
+
+static void post_read_shm_hook(syscall_ctx_t *ctx) {
+	const int fd = ctx->arg[SYSCALL_ARG0];
+	off_t pos;
+	size_t len, n = 0;
+
+	if (shmActive && (long)ctx->ret >= 0 && !IS_STDFD(fd) &&
+			fdset.find(fd) != fdset.end() &&
+			(pos = lseek(fd, 0, SEEK_CUR)) >= 0) {
+		pos -= ctx->ret;
+		len = MIN(*(UINT32 *)shmInput, shmInputMax);
+		if ((size_t)pos < len)
+			n = MIN((size_t)ctx->arg[SYSCALL_ARG2], len - pos);
+		memcpy((void *)ctx->arg[SYSCALL_ARG1], shmInput + SHMIN_HDR + pos, n);
+		lseek(fd, pos + n, SEEK_SET);
+		ctx->ret = n;
+		PIN_SetContextReg((CONTEXT *)ctx->aux, REG_GAX, n);
+	}
+	post_read_hook<tag_t>(ctx);
+}
+
+/*
+ * Fork server (-forkserver 1), with the pipes and replies of bbcounts2
+ * (the pid and the wait status go out in one 8-byte write). Pin, libdft
+ * and the program run once, up to the first open() of the input file
+ * (with -shminput, up to its first read()); there the process stops and
+ * forks a child for every request. Nothing has been read from the input
+ * yet, so the children inherit a clean tagmap and empty cmp/lea buffers;
+ * they only need fresh output files and fd bookkeeping (ForkChild()).
+ */
+static bool forkStarted = false;
+
+static void ForkChild(void) {
+	close(FORKSRV_FD);
+	close(FORKSRV_FD + 1);
+	pid = getpid();
+	OpenOutputs();
+	cov_reset();
+	if (shmInput != NULL) {
+		/* the input is already open: keep its ufd and log it again */
+		shmActive = true;
+		PROVLOG::exec(exename, pid);
+		for ( auto &fd : fdset )
+			PROVLOG::open(PROVLOG::ufdmap[fd], fdname(fd), fcntl(fd, F_GETFL), 0);
+		return;
+	}
+	fdset.clear();
+	PROVLOG::ufdmap.reset();
+	bzero(stdcount, sizeof(stdcount));
+	WatchStdFds();
+}
+
+static VOID ForkServer(void) {
+	UINT32 msg = 0;
+	INT32 reply[2];
+	pid_t child;
+
+	forkStarted = true;
+	if (write(FORKSRV_FD + 1, &msg, 4) != 4)
+		return;
+	while (true) {
+		if (read(FORKSRV_FD, &msg, 4) != 4)
+			PIN_ExitProcess(0);
+		child = fork();
+		if (child < 0)
+			PIN_ExitProcess(1);
+		if (child == 0) {
+			ForkChild();
+			return;
+		}
+		reply[0] = child;
+		if (waitpid(child, &reply[1], 0) < 0)
+			PIN_ExitProcess(1);
+		if (write(FORKSRV_FD + 1, reply, sizeof(reply)) != sizeof(reply))
+			PIN_ExitProcess(0);
+	}
+}
+
+static VOID ForkCheck(ADDRINT num, ADDRINT arg0) {
+	if (forkStarted)
+		return;
+	if (shmInput != NULL) {
+		if (num == __NR_read && !IS_STDFD((int)arg0) &&
+				fdset.find((int)arg0) != fdset.end())
+			ForkServer();
+	}
+	else if (num == __NR_open && arg0 != 0 &&
+			is_dtracker_input_path((const char *)arg0))
+		ForkServer();
+}
+
+static VOID ForkIns(INS ins, VOID *v) {
+	if (forkStarted || !INS_IsSyscall(ins))
+		return;
+	INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ForkCheck,
+			IARG_SYSCALL_NUMBER, IARG_SYSARG_VALUE, 0, IARG_END);
+}
+
 /*
  * Called before exit.
  * Handles any fd's that haven't been closed.
@@ -155,6 +399,12 @@ static void OnExit(INT32, void *) {
 		PROVLOG::ufdmap.del(fd);
 		PROVLOG::close(ufd);
 	}
+	PROVLOG::flush();
+	cov_fini();
+	/* replay what is left of the handler logs (-replay) */
+	replay_fini();
+	/* merge the per-thread cmp/lea/token/patch records */
+	cmp_log_flush();
         //OutFile << out.str() << endl;
 	out.flush();
 	out.close();
@@ -169,6 +419,69 @@ static void OnExit(INT32, void *) {
 		lea_offset.flush();
 		lea_offset.close();
 	}
+	if (atoi(TokenRawKnob.Value().c_str()) ) {
+		token_offset.flush();
+		token_offset.close();
+	}
+	if (atoi(PatchRawKnob.Value().c_str()) ) {
+		patch_offset.flush();
+		patch_offset.close();
+	}
+}
+
+/*
+ * The raw provenance is buffered (block-wise with -provbin): flush it
+ * before the program forks, or both processes write the pending events.
+ */
+static VOID ProvFork(THREADID tid, const CONTEXT *ctx, VOID *v) {
+	PROVLOG::flush();
+}
+
+/* The outputs of a run that ends with PIN_Detach() (DetachCheck()). */
+static void OnDetach(void *v) {
+	OnExit(0, v);
+}
+
+/*
+ * Once the input files have been opened and closed again, and no tag is
+ * live in memory or in a register, nothing can get tainted anymore, and
+ * the rest of the program may run natively (-autodetach). The same holds
+ * once the -maxcmp budget of cmp.out records is used up. Called after the
+ * syscall hooks, at every syscall exit.
+ */
+static bool detaching = false;
+static bool inputOpened = false;
+static bool autoDetach = false;
+
+static VOID DetachCheck(THREADID tid, CONTEXT *ctx, SYSCALL_STANDARD std, VOID *v) {
+	size_t sources = 0;
+
+	if (detaching)
+		return;
+	for ( auto &fd : fdset )
+		if (fd == STDIN_FILENO || !IS_STDFD(fd))
+			sources++;
+	if (sources > 0)
+		inputOpened = true;
+
+	if (limit_cmp > 0 && cmp_count >= limit_cmp)
+		LOG("Detaching: -maxcmp reached.\n");
+	else if (autoDetach && inputOpened &&
+			sources == 0 && !libdft_tainted())
+		LOG("Detaching: no live taint.\n");
+	else
+		return;
+	detaching = true;
+	PIN_Detach();
+}
+
+/* -taint 2: propagation starts once an input file is open (cov_input()). */
+static VOID CovInputCheck(THREADID tid, CONTEXT *ctx, SYSCALL_STANDARD std, VOID *v) {
+	for ( auto &fd : fdset )
+		if (fd == STDIN_FILENO || !IS_STDFD(fd)) {
+			cov_input();
+			return;
+		}
 }
 
 VOID DbgInstruction( INS ins, VOID *v )
@@ -194,39 +507,81 @@ int main(int argc, char **argv) {
 
 	IMG_AddInstrumentFunction(ImageLoad, 0);
 	PIN_AddFiniFunction(OnExit, 0);
+	if (atoi(ForkServerKnob.Value().c_str()) || !ShmInputKnob.Value().empty())
+		INS_AddInstrumentFunction(ForkIns, 0);
 
 #ifdef DTRACKER_DEBUG
 	INS_AddInstrumentFunction(CheckMagicValue, 0);
 #endif
 //        INS_AddInstrumentFunction( DbgInstruction, 0 );
 	
+	cov_init(BBOutKnob.Value(), BBLibsKnob.Value(), atoi(TaintModeKnob.Value().c_str()),
+			SeenKnob.Value(), NewBBKnob.Value());
+
+	/*
+	 * Decoupled propagation. The fork server forks from analysis code,
+	 * and the replay threads would not be in the children.
+	 */
+	if (atoi(ReplayKnob.Value().c_str()) > 0) {
+		if (atoi(ForkServerKnob.Value().c_str()) || !ShmInputKnob.Value().empty())
+			LOG("-replay is ignored with the fork server.\n");
+		else if (unlikely(replay_init(atoi(ReplayKnob.Value().c_str())) != 0))
+			goto err;
+	}
+
 	LOG("Initializing libdft.\n");
-	if (unlikely(libdft_init() != 0))
+	if (unlikely(libdft_init(cov_version_mask()) != 0))
+		goto err;
+
+	/*
+	 * Registered after libdft_init(), so that it runs after the syscall
+	 * hooks. Block counts (-bbout) need the whole run: no detaching then.
+	 * With -replay, the logs of the other threads may still hold taint
+	 * that only the thread itself can sync. The live tag count is only
+	 * kept when it is needed (tagmap_track).
+	 */
+	limit_cmp = atol(MaxCmpKnob.Value().c_str());
+	autoDetach = atoi(AutoDetachKnob.Value().c_str()) && BBOutKnob.Value().empty();
+	if (autoDetach && replay_on) {
+		LOG("-autodetach is ignored with -replay.\n");
+		autoDetach = false;
+	}
+	tagmap_track = autoDetach;
+	if ((autoDetach || limit_cmp > 0) && BBOutKnob.Value().empty()) {
+		PIN_AddSyscallExitFunction(DetachCheck, 0);
+		PIN_AddDetachFunction(OnDetach, 0);
+	}
+	if (atoi(TaintModeKnob.Value().c_str()) == COV_TAINT_LAZY)
+		PIN_AddSyscallExitFunction(CovInputCheck, 0);
+	PIN_AddForkFunction(FPOINT_BEFORE, ProvFork, 0);
+
+	if (!ShmInputKnob.Value().empty() && MapShmInput(ShmInputKnob.Value()) != 0) {
+		LOG("Cannot map " + ShmInputKnob.Value() + ".\n");
 		goto err;
+	}
 
 	// reset counters
 	bzero(stdcount, sizeof(stdcount));
 	//out1.open("dbg.out");
-	// Open raw prov file.
-	// This file is to be post-processed to get the data in a proper format.
-	PROVLOG::rawProvStream.open(ProvRawKnob.Value().c_str());
-	out.open(CmpRawKnob.Value().c_str(), std::ios::binary | std::ios::trunc | std::ios::out );
-        if (atoi(ReadRawKnob.Value().c_str()) ) {
-            read_offset.open("read.out");
-        }
+	// Open raw prov file and the cmp/lea outputs.
+	// The raw prov file is to be post-processed to get the data in a proper format.
+	OpenOutputs();
 
 	mmap_type = 0;
         if (atoi(MmapKnob.Value().c_str())) {
 	    mmap_type = 1;
             //read_offset.open("read.out");
         }
-	if (atoi(LeaRawKnob.Value().c_str()) ) {
-            lea_offset.open("lea.out");
-        }
 
 	limit_offset = atoi(SizeKnob.Value().c_str());
 	limit_lea = atoi(SizeLeaKnob.Value().c_str());
+	limit_token = atoi(SizeTokenKnob.Value().c_str());
         filename = FileKnob.Value();
+	if (atoi(InputFdKnob.Value().c_str()) >= 0 &&
+			set_dtracker_input(atoi(InputFdKnob.Value().c_str())) != 0) {
+		LOG("Cannot stat the -inputfd fd.\n");
+		goto err;
+	}
 
         
         LOG(std::string(filename) + "\n");
@@ -248,7 +603,10 @@ int main(int argc, char **argv) {
 	(void)syscall_set_post(&syscall_desc[__NR_close], post_close_hook<tag_t>);
 
 	/* dtracker_read.cpp: read(2), readv(2) */
-	(void)syscall_set_post(&syscall_desc[__NR_read], post_read_hook<tag_t>);
+	if (shmInput != NULL)
+		(void)syscall_set_post(&syscall_desc[__NR_read], post_read_shm_hook);
+	else
+		(void)syscall_set_post(&syscall_desc[__NR_read], post_read_hook<tag_t>);
 	(void)syscall_set_post(&syscall_desc[__NR_readv], post_readv_hook<tag_t>);
 	(void)syscall_set_post(&syscall_desc[__NR_pread64], post_pread_hook<tag_t>);
 
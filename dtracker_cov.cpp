@@ -0,0 +1,250 @@
+#include "dtracker_cov.H"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pin.H"
+#include "dtracker.H"
+#include "libdft_api.h"
+
+/* must match bbcounts2.cpp */
+#define SEEN_SLOTS (1 << 20)
+#define UNMONITORED_IMAGE 0xffff
+#define FNV_PRIME 16777619U
+
+/* image index (0: main executable, 1..: -bblibs) and link-time address */
+typedef UINT64 BBID;
+
+typedef struct {
+	ADDRINT low;
+	ADDRINT high;
+	ADDRINT offset;
+	UINT32 index;
+} cov_image_t;
+
+static std::vector<cov_image_t> images;
+static std::vector<std::string> libnames;
+static std::map<BBID, UINT32 *> counts;
+static std::string bbout_file;
+static std::string newbb_file;
+static UINT64 *seenmap = NULL;
+static int taint_mode = COV_TAINT_ON;
+static REG mode_reg;
+static ADDRINT taint_on = 0;
+
+static BBID cov_id(ADDRINT addr) {
+	for (std::vector<cov_image_t>::iterator it = images.begin(); it != images.end(); ++it)
+		if (addr >= it->low && addr <= it->high)
+			return ((BBID)it->index << 32) | (UINT32)(addr - it->offset);
+	return ((BBID)UNMONITORED_IMAGE << 32) | (UINT32)addr;
+}
+
+/*
+ * Slot of a block in the -seen set, as idSetAdd() of bbcounts2 probes it:
+ * the slot that holds the block or the free slot it goes to, NULL if the
+ * set is full.
+ */
+static UINT64 *cov_seenslot(BBID id) {
+	UINT32 key = (UINT32)id ^ ((UINT32)(id >> 32) * FNV_PRIME);
+	UINT32 h = key * 0x9e3779b1U;
+
+	h ^= h >> 16;
+	for (UINT32 i = 0; i < SEEN_SLOTS; i++) {
+		UINT64 *slot = &seenmap[(h + i) & (SEEN_SLOTS - 1)];
+		if (*slot == id || *slot == 0)
+			return slot;
+	}
+	return NULL;
+}
+
+static BOOL cov_seen(BBID id) {
+	UINT64 *slot = cov_seenslot(id);
+	return slot != NULL && *slot == id;
+}
+
+static VOID PIN_FAST_ANALYSIS_CALL cov_count(UINT32 *counter) {
+	(*counter)++;
+}
+
+/* a new block: the records are written from here on */
+static VOID cov_activate(void) {
+	taint_on = 1;
+	cmp_log_on = 1;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL cov_mode(void) {
+	return taint_on;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL cov_quiet(void) {
+	return !cmp_log_on;
+}
+
+static VOID cov_imgload(IMG img, VOID *v) {
+	cov_image_t image;
+
+	image.low = IMG_LowAddress(img);
+	image.high = IMG_HighAddress(img);
+	image.offset = IMG_LoadOffset(img);
+	image.index = UNMONITORED_IMAGE;
+	if (IMG_IsMainExecutable(img))
+		image.index = 0;
+	else
+		for (UINT32 i = 0; i < libnames.size(); i++)
+			if (IMG_Name(img).find(libnames[i]) != std::string::npos) {
+				image.index = i + 1;
+				break;
+			}
+	if (image.index != UNMONITORED_IMAGE)
+		images.push_back(image);
+}
+
+static VOID cov_trace(TRACE trace, VOID *v) {
+	BOOL plain = (TRACE_Version(trace) == COV_VERSION_PLAIN);
+
+	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+		INS head = BBL_InsHead(bbl);
+		BBID id = cov_id(BBL_Address(bbl));
+		BOOL monitored = ((id >> 32) != UNMONITORED_IMAGE);
+
+		if (taint_mode == COV_TAINT_LAZY && plain) {
+			if (monitored && !cov_seen(id))
+				INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)cov_activate, IARG_END);
+			INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)cov_mode,
+					IARG_FAST_ANALYSIS_CALL, IARG_RETURN_REGS, mode_reg, IARG_END);
+			INS_InsertVersionCase(head, mode_reg, 1, COV_VERSION_TAINT, IARG_END);
+		}
+		/*
+		 * Once the input is open (cov_input()), the program runs the
+		 * taint version before it reaches a new block; the records
+		 * start there too.
+		 */
+		else if (taint_mode == COV_TAINT_LAZY && monitored && !cov_seen(id)) {
+			INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)cov_quiet,
+					IARG_FAST_ANALYSIS_CALL, IARG_END);
+			INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)cov_activate, IARG_END);
+		}
+		if (!monitored || bbout_file.empty())
+			continue;
+		std::pair<std::map<BBID, UINT32 *>::iterator, bool> ret =
+			counts.insert(std::make_pair(id, (UINT32 *)NULL));
+		if (ret.second)
+			ret.first->second = new UINT32(0);
+		BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)cov_count,
+				IARG_FAST_ANALYSIS_CALL, IARG_PTR, ret.first->second, IARG_END);
+	}
+}
+
+static UINT64 *cov_mapseen(const std::string &path) {
+	int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+	UINT64 *map;
+
+	if (fd == -1 || ftruncate(fd, SEEN_SLOTS * sizeof(UINT64)) == -1) {
+		perror("Error opening coverage set");
+		exit(0);
+	}
+	map = (UINT64 *)mmap(0, SEEN_SLOTS * sizeof(UINT64), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Error mmapping coverage set");
+		exit(0);
+	}
+	return map;
+}
+
+void cov_init(const std::string &bbout, const std::string &libs, int taint,
+		const std::string &seen, const std::string &newbb) {
+	std::stringstream ss(libs);
+	std::string lib;
+
+	bbout_file = bbout;
+	newbb_file = newbb;
+	taint_mode = taint;
+	while (!libs.empty() && std::getline(ss, lib, ','))
+		libnames.push_back(lib);
+	if (!seen.empty())
+		seenmap = cov_mapseen(seen);
+	/* without the set, every block would be new */
+	if (taint_mode == COV_TAINT_LAZY && seenmap == NULL)
+		taint_mode = COV_TAINT_ON;
+	if (taint_mode == COV_TAINT_LAZY) {
+		mode_reg = PIN_ClaimToolRegister();
+		if (!REG_valid(mode_reg)) {
+			LOG("cov_init: register claim failed, tainting from the start\n");
+			taint_mode = COV_TAINT_ON;
+		}
+	}
+	if (taint_mode == COV_TAINT_LAZY)
+		cmp_log_on = 0;
+	IMG_AddInstrumentFunction(cov_imgload, 0);
+	TRACE_AddInstrumentFunction(cov_trace, 0);
+}
+
+/* version mask for libdft_init() */
+ADDRINT cov_version_mask(void) {
+	return taint_mode == COV_TAINT_ON ? 0 : COV_VERSION_TAINT;
+}
+
+/*
+ * The input has been opened (-taint 2): taint is propagated from here on,
+ * so that the copies made of it before the first new block are tainted.
+ */
+void cov_input(void) {
+	taint_on = 1;
+}
+
+/* zeroes the counts; a forked child (-forkserver) counts its own run only */
+void cov_reset(void) {
+	for (std::map<BBID, UINT32 *>::iterator it = counts.begin(); it != counts.end(); ++it)
+		*it->second = 0;
+}
+
+/*
+ * Writes the counts (-bbout), and, with -seen, adds the blocks to the set
+ * and writes the ones that were not in it to -newbb (their number, then
+ * the blocks), like bbcounts2.
+ */
+void cov_fini(void) {
+	std::vector<BBID> fresh;
+	FILE *f;
+
+	if (bbout_file.empty())
+		return;
+	f = fopen(bbout_file.c_str(), "w");
+	if (f == NULL)
+		return;
+	for (std::map<BBID, UINT32 *>::iterator it = counts.begin(); it != counts.end(); ++it) {
+		UINT64 *slot;
+
+		if (*it->second == 0)
+			continue;
+		fprintf(f, "0x%llx %u\n", (unsigned long long)it->first, *it->second);
+		if (seenmap == NULL || cov_seen(it->first))
+			continue;
+		if ((slot = cov_seenslot(it->first)) != NULL)
+			*slot = it->first;
+		fresh.push_back(it->first);
+	}
+	fclose(f);
+	if (seenmap == NULL || newbb_file.empty())
+		return;
+	f = fopen(newbb_file.c_str(), "w");
+	if (f == NULL)
+		return;
+	fprintf(f, "%u\n", (UINT32)fresh.size());
+	for (std::vector<BBID>::iterator it = fresh.begin(); it != fresh.end(); ++it)
+		fprintf(f, "0x%llx ", (unsigned long long)*it);
+	fprintf(f, "\n");
+	fclose(f);
+}
+
+/* vim: set noet ts=4 sts=4 sw=4 ai : */
@@ -6,6 +6,7 @@ import pickle
 import math
 import random
 import shutil
+import struct
 
 def die(msg) :
     print msg
@@ -129,6 +130,16 @@ def taint_based_change(ch,pr):
                     continue
                 chlist[of]=random.choice(extVal)
             
+    #next apply some of the compare patches of pr; bytes are already in input order.
+    if pr in config.PATCHMAP:
+        if len(config.PATCHMAP[pr])>0:
+            tpat=random.sample(config.PATCHMAP[pr],max(1,len(config.PATCHMAP[pr])/3))
+            for patch in tpat:
+                for of,byte in patch:
+                    if of >= len(chlist) or of < -len(chlist):
+                        continue
+                    chlist[of]=byte
+
 
     if pr in config.TAINTMAP:
         #we want to do 2 things:
@@ -500,6 +511,16 @@ def createNextGeneration3(fit,gn):
         die("Something went wrong while creating next gen inputs.. check it!")
     return 0
 
+def bbKey(i,adr):
+    ''' ID of the BB at link-time address adr of the i-th monitored binary (0: the SUT, 1..: the libraries in the order of -b), as bbcounts2 reports it: the index in the upper 32 bits, the address in the lower 32 bits. It does not depend on where the binary is loaded.'''
+    return (i<<32)|adr
+
+def bbModule(bbid):
+    return bbid>>32
+
+def bbOffset(bbid):
+    return bbid&0xffffffff
+
 def prepareBBOffsets():
     ''' This functions load pickle files to prepare BB weights and strings found in binary. The strings are read from a pickle file, generated by IDAPython. This file contains a tuple of two sets (A,B). A= set of all strings found at CMP instructions. B= set of individual bytes, generated from strings of A and CMP.
 '''
@@ -509,7 +530,7 @@ def prepareBBOffsets():
         pFD=open(config.LIBPICKLE[i],"r")
         tBB=pickle.load(pFD)
         for tb in tBB:
-            ad=tb+int(config.LIBOFFSETS[i],0)
+            ad=bbKey(i,tb)
             # we do not consider weights greater than BBMAXWEIGHT and we take log2 of weights as final weight.
             if tBB[tb][0]>config.BBMAXWEIGHT:
                 config.ALLBB[ad]=int(math.log(config.BBMAXWEIGHT,2))
@@ -531,26 +552,79 @@ def prepareBBOffsets():
     config.ALLSTRINGS.append(tempFull.copy())
     config.ALLSTRINGS.append(tempByte.copy())
     
-def prepareLibBBOffsets(loffset):
-    ''' This functions load pickle files to prepare BB weights in the case of loadtime image address change.
-'''
-    config.ALLBB.clear()
-    config.cALLBB.clear()
-    for i in range(config.LIBNUM):
-        pFD=open(config.LIBPICKLE[i],"r")
-        tBB=pickle.load(pFD)
-        if i==0:
-            for tb in tBB:
-                ad=tb+int(config.LIBOFFSETS[i],0)
-                config.ALLBB[ad]=tBB[tb][0]
-                #config.cAPPBB.add(ad)
-                config.cALLBB.add(ad)
-        else:
-            for tb in tBB:
-                ad=tb+loffset
-                config.ALLBB[ad]=tBB[tb][0]
-                config.cALLBB.add(ad)
-        pFD.close()
+WEIGHT_SET_SLOTS=131072 # must match bbcounts2.cpp
+
+def seenWeightsSize(num):
+    ''' size of the "seen" part of a weight table of num records: the padded seen bytes, then the set of the other BBs.'''
+    return ((num+7)&~7)+8*WEIGHT_SET_SLOTS
+
+def writeWeights():
+    ''' writes config.ALLBB as the weight table of bbcounts2 (-weights): "BBW2", count, BBMAXFREQ, 0, the sorted (BB ID, weight) records, then the "seen" bytes and BB set of the tool (see bbcounts2.cpp).'''
+    adrs=sorted(config.ALLBB)
+    wFD=open(config.WEIGHTFILE,"wb")
+    wFD.write(struct.pack('=4sIII',"BBW2",len(adrs),config.BBMAXFREQ,0))
+    wFD.write(''.join(struct.pack('=Qd',ad,config.ALLBB[ad]) for ad in adrs))
+    wFD.write('\0'*seenWeightsSize(len(adrs)))
+    wFD.close()
+
+def clearSeenWeights():
+    ''' clears the "seen" bytes and BB set of the weight table; called when SEENBB is cleared.'''
+    wFD=open(config.WEIGHTFILE,"r+b")
+    num=struct.unpack('=4sIII',wFD.read(16))[1]
+    wFD.seek(16+16*num)
+    wFD.write('\0'*seenWeightsSize(num))
+    wFD.close()
+
+def writeBlockList():
+    ''' writes the IDs of all statically known BBs (config.ALLBB) for bbtrap (-blocks), one per line.'''
+    bFD=open(config.BLOCKLIST,"w")
+    for bb in sorted(config.ALLBB):
+        bFD.write("0x%x\n"%(bb,))
+    bFD.close()
+
+def writeErrorBB():
+    ''' writes the known error BBs for bbcounts2 (-errorbb).'''
+    eFD=open(config.ERRORBBFILE,"w")
+    for ebb in config.ERRORBBALL.union(config.TEMPERRORBB):
+        eFD.write("0x%x\n"%(ebb,))
+    eFD.close()
+
+def markNewBBs(diffb,cinput):
+    ''' records that cinput discovered the BBs in diffb; older inputs whose new BBs are all in diffb are dropped.'''
+    todel=set()
+    for tk, tv in config.TMPBBINFO.iteritems():
+        if tv <= diffb:
+            todel.add(tk)
+    for tb in todel:
+        del config.TMPBBINFO[tb]
+    config.TMPBBINFO[cinput]=diffb.copy()
+
+def fitnesTool(cinput,ilen):
+    '''
+    same as fitnesCal2(), but from the sums that bbcounts2 computed (config.TOOLFITNESS): only the negative weight of error BBs, which depends on fuzzer settings, is applied here.
+    '''
+    score,errlg,numEBB,numBB,bbNum,fresh=config.LASTFIT
+    if numEBB>0:
+        ew=-numBB*config.ERRORBBPERCENTAGE/numEBB
+        score=score+(errlg*ew)
+    # BBs new in this generation (the seen bytes are cleared with SEENBB); LASTNEW is only used for NOVELIN
+    diffb=set(fresh)-config.SEENBB
+    config.cPERGENBB.update(diffb)
+    diffe=newEdges()
+    if len(diffb)>0 or len(diffe)>0:
+        config.SEENBB.update(diffb)
+        diffb.update(diffe)
+        markNewBBs(diffb,cinput)
+    if ilen > config.MAXINPUTLEN:
+        return (score*bbNum)/int(math.log(ilen+1,2))
+    else:
+        return score*bbNum
+
+def newEdges():
+    ''' returns the (edge, hit count class) pairs of the last execution that were not seen so far, and marks them as seen. Empty unless config.EDGEMAP is set.'''
+    diffe=config.LASTEDGES-config.SEENEDGE
+    config.SEENEDGE.update(diffe)
+    return diffe
 
 def fitnesCal2(bbdict, cinput,ilen):
     '''
@@ -566,27 +640,14 @@ def fitnesCal2(bbdict, cinput,ilen):
         ew=-len(bbdict)*config.ERRORBBPERCENTAGE/numEBB
     tset=set(bbdict)-tempset # we make sure that newly discovered BBs are not related to error BB.
     config.cPERGENBB.update(tset)
-    if not tset <=config.SEENBB:# and not tset <=tempset:
-        diffb=tset-config.SEENBB
+    diffe=newEdges()
+    diffb=tset-config.SEENBB # new in this generation; LASTNEW (-seen) is only used for NOVELIN
+    if len(diffb)>0 or len(diffe)>0:# and not tset <=tempset:
         config.SEENBB.update(diffb)
-        todel=set()
-        tofix=set()
-        for tk, tv in config.TMPBBINFO.iteritems():
-            if tv <= diffb:
-                todel.add(tk)
-            #elif len(tv & diffb)>0:
-            #    tofix.add(tk)
-            #else:
-            #    pass
-        for tb in todel:
-            del config.TMPBBINFO[tb]
-        #for tb in tofix:
-        #    config.TMPBBINFO[tb].difference_update(diffb)
-        config.TMPBBINFO[cinput]=diffb.copy()
+        diffb.update(diffe)
+        markNewBBs(diffb,cinput)
        # del tempset
-        del todel
         del diffb
-        del tofix
         #return 10 #some random value as we don;t care much about fitness score of such input as they go to next gen anyway!
     for bbadr in bbdict: 
         #config.cPERGENBB.add(bbadr)#added for code-coverage
@@ -630,9 +691,11 @@ def fitnesNoWeight(bbdict, cinput,ilen):
     tempset=config.ERRORBBALL.union(config.TEMPERRORBB)
     tset=set(bbdict)
     config.cPERGENBB.update(tset)
-    if not tset <=config.SEENBB and not tset <=tempset:
+    diffe=newEdges()
+    if (not tset <=config.SEENBB and not tset <=tempset) or len(diffe)>0:
         diffb=tset-config.SEENBB
         config.SEENBB.update(diffb)
+        diffb.update(diffe)
         todel=set()
         tofix=set()
         for tk, tv in config.TMPBBINFO.iteritems():
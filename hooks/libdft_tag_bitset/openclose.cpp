@@ -47,7 +47,7 @@ void post_open_hook<libdft_tag_bitset>(syscall_ctx_t *ctx) {
 	/* Resolve fd to full pathname. Use this instead of syscall argument. */
 	const std::string fdn = fdname(_FD);
 
-	if ( !in_dtracker_whitelist(fdn) && !path_isdir(fdn) ) {
+	if ( !in_dtracker_whitelist_fd(_FD, fdn) && !path_isdir(fdn) ) {
 		const PROVLOG::ufd_t ufd = PROVLOG::ufdmap[_FD];
 		fdset.insert(_FD);
 
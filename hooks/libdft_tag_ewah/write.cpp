@@ -111,6 +111,7 @@ void post_write_hook<libdft_tag_ewah>(syscall_ctx_t *ctx) {
 		}
 	}
 
+	/* no PROVLOG::write_range(): the tags do not name the origin ufd */
 	for(ssize_t i=0; i<_N_WRITTEN; i++) { //loop through memory locations
 		tag_t tag = tagmap_getb(_BUF+i);
 		stringstream ss;
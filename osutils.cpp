@@ -13,6 +13,18 @@
 
 
 std::string filename;
+dev_t input_dev = 0;
+ino_t input_ino = 0;
+
+int set_dtracker_input(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	input_dev = st.st_dev;
+	input_ino = st.st_ino;
+	return 0;
+}
 
 std::string fdname(int fd) {
 	char ppath[PATH_MAX];
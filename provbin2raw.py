@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+
+# Converter from the binary raw provenance output (dtracker -provbin 1)
+# to the text raw provenance output.
+# The output can be piped to raw2ttl.py/raw2dsl.py, e.g.:
+#   python provbin2raw.py rawprov.out | python raw2ttl.py
+#
+# The layout is described in provlog.H. Records are read one at a time,
+# so arbitrarily large logs are converted in constant memory.
+
+import argparse
+import os
+import struct
+import sys
+
+
+
+#### Exceptions #####################################################
+class Error(Exception):
+	"""Base class for exceptions in this module."""
+	pass
+
+class FormatError(Error):
+	"""Raised when the input is not a binary raw provenance log."""
+	def __init__(self, msg):
+		self.msg = msg
+	def __str__(self):
+		return self.msg
+
+
+
+#### Binary format ##################################################
+PROVBIN_MAGIC = 'DTPROVB1'
+PROVBIN_VERSION = 1
+
+HDR = struct.Struct('=8sII')		# provbin_hdr_t
+REC = struct.Struct('=BBHI')		# provbin_rec_t
+OPEN = struct.Struct('=II')		# provbin_open_t
+NAME = struct.Struct('=II')		# provbin_name_t
+WRITE = struct.Struct('=IIQQQ')		# provbin_write_t
+
+RANGE_TYPES = ['NONE', 'SEQ', 'REP']	# range_info_t
+
+
+
+#### Converter ######################################################
+class ProvBinConverter:
+	def __init__(self, out):
+		self.out = out
+		self.exename = 'N/A'
+
+	def convert(self, f):
+		hdr = f.read(HDR.size)
+		if len(hdr) < HDR.size:
+			raise FormatError('truncated header')
+		magic, version, _ = HDR.unpack(hdr)
+		if magic != PROVBIN_MAGIC:
+			raise FormatError('bad magic')
+		if version != PROVBIN_VERSION:
+			raise FormatError('unsupported version %d' % version)
+
+		while True:
+			rec = f.read(REC.size)
+			if len(rec) < REC.size:
+				break
+			rtype, sub, size, ufd = REC.unpack(rec)
+			if size < REC.size:
+				raise FormatError('bad record size %d' % size)
+			payload = f.read(size - REC.size)
+			if len(payload) < size - REC.size:
+				break
+			handler = getattr(self, 'rec_' + chr(rtype), None)
+			if handler is None:
+				raise FormatError('unknown record type %r' % chr(rtype))
+			handler(sub, ufd, payload)
+
+	def rec_o(self, created, ufd, payload):
+		flags, namelen = OPEN.unpack_from(payload)
+		fdname = payload[OPEN.size:OPEN.size+namelen]
+		w = self.out.write
+
+		w('o:ufd%d:%s\n' % (ufd, fdname))
+		if not (flags & os.O_WRONLY):
+			w('u:%s:%s\n' % (self.exename, fdname))
+		if flags & (os.O_WRONLY|os.O_RDWR):
+			if created:
+				w('#g:created\n')
+				w('g:c:%s:%s\n' % (self.exename, fdname))
+			elif flags & os.O_TRUNC:
+				w('#g:truncated\n')
+				w('g:t:%s:%s\n' % (self.exename, fdname))
+			else:
+				w('#g:updated\n')
+				w('g:u:%s:%s\n' % (self.exename, fdname))
+
+	def rec_c(self, sub, ufd, payload):
+		self.out.write('c:ufd%d\n' % ufd)
+
+	def rec_x(self, sub, pid, payload):
+		_, namelen = NAME.unpack_from(payload)
+		self.exename = payload[NAME.size:NAME.size+namelen]
+		self.out.write('x:%d:%s\n' % (pid, self.exename))
+
+	def rec_w(self, rtype, ufd, payload):
+		ufd_origin, _, off_dest, off_origin, length = WRITE.unpack_from(payload)
+		self.out.write('w:%s:ufd%d:%d:ufd%d:%d:%d\n' % (
+			RANGE_TYPES[rtype], ufd, off_dest, ufd_origin, off_origin, length))
+
+
+
+#### main ###########################################################
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description='Convert DataTracker binary raw format to the text raw format.')
+	parser.add_argument('files', metavar='file', nargs='*', help='specify input files (default: stdin)')
+	args = parser.parse_args()
+
+	converter = ProvBinConverter(sys.stdout)
+	try:
+		if not args.files:
+			converter.convert(sys.stdin)
+		for fn in args.files:
+			with open(fn, 'rb') as f:
+				converter.convert(f)
+	except FormatError as e:
+		sys.stderr.write('%s: %s\n' % (sys.argv[0], e))
+		sys.exit(1)
@@ -0,0 +1,733 @@
+/*
+ * provconv: streaming converter from DataTracker raw provenance to
+ * PROV/Turtle (like raw2ttl.py) or SPADE DSL (like raw2dsl.py).
+ *
+ * Both the text raw format and the binary one (dtracker -provbin 1) are
+ * accepted; the format is detected from the first bytes of each input.
+ * Events are converted as they are read. The only state kept is:
+ *	- the names of the open ufds, dropped on their close record,
+ *	- the derived-from sets of the open ufds,
+ *	- the files with a pending wasGeneratedBy and, for DSL, the vertex
+ *	  id of the current process.
+ * None of that grows with the length of the log. Unlike raw2ttl.py, a
+ * write whose origin ufd is already closed is reported and skipped.
+ * A file opened again after all of its ufds were closed gets a new
+ * DSL vertex.
+ *
+ * With -j N the write records are sharded by destination ufd over N
+ * worker threads; the other events are seen by every worker. Each worker
+ * writes to its own file (<out>.0 .. <out>.N-1). Process and file vertices
+ * go to shard 0, so for DSL load <out>.0 first. A deferred
+ * wasGeneratedBy may be emitted once per shard.
+ *
+ * Build: make provconv
+ */
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "provbin.H"
+
+/* events per batch handed to a worker, batches queued per worker */
+#define PROVCONV_BATCH		1024
+#define PROVCONV_QUEUE_MAX	16
+
+static const char *range_types[] = { "NONE", "SEQ", "REP" };
+
+/**** events *******************************************************/
+struct event_t {
+	char		op;		/* c, g, o, u, w, x, or # (comment) */
+	char		mode;		/* g: c/t/u/g */
+	int		rtype;		/* w: index in range_types */
+	uint32_t	ufd;		/* c/o: ufd; w: destination */
+	uint32_t	ufd_origin;	/* w */
+	uint64_t	off;		/* w: destination offset */
+	uint64_t	off_origin;	/* w */
+	uint64_t	length;		/* w */
+	std::string	pid;		/* x */
+	std::string	name;		/* file, program or comment */
+};
+
+/* an open file; id numbers the files in the order they were opened */
+struct file_t {
+	std::string	name;
+	uint64_t	id;
+
+	bool operator<(const file_t & f) const { return this->id < f.id; }
+};
+
+/*
+ * Files of the open ufds. A file stays while one of its ufds is open,
+ * and keeps its id for that long; close records drop the ufd.
+ */
+class UFDNames {
+	public:
+		const file_t *set(uint32_t ufd, const std::string & name) {
+			auto it = this->files.find(name);
+
+			this->del(ufd);
+			if (it == this->files.end()) {
+				it = this->files.emplace(name, entry_t()).first;
+				it->second.file.name = name;
+				it->second.file.id = this->next++;
+			}
+			it->second.opens++;
+			this->map[ufd] = &it->second;
+			return &it->second.file;
+		}
+		const file_t *get(uint32_t ufd) const {
+			auto it = this->map.find(ufd);
+			return it == this->map.end() ? NULL : &it->second->file;
+		}
+		const file_t *find(const std::string & name) const {
+			auto it = this->files.find(name);
+			return it == this->files.end() ? NULL : &it->second.file;
+		}
+		void del(uint32_t ufd) {
+			auto it = this->map.find(ufd);
+
+			if (it == this->map.end())
+				return;
+			entry_t *f = it->second;
+			this->map.erase(it);
+			if (--f->opens == 0) {
+				std::string name(f->file.name);
+				this->files.erase(name);
+			}
+		}
+	private:
+		struct entry_t {
+			file_t		file;
+			uint32_t	opens = 0;
+		};
+		uint64_t next = 0;
+		std::unordered_map<uint32_t, entry_t *> map;
+		std::unordered_map<std::string, entry_t> files;	/* stable references */
+};
+
+/**** converters ***************************************************/
+class Converter {
+	public:
+		Converter(FILE *out, int shard, int nshards, uint64_t minrange) :
+			out(out), shard(shard), nshards(nshards), minrange(minrange) {}
+		virtual ~Converter() {}
+
+		void process(const event_t & e) {
+			switch (e.op) {
+				case '#': if (this->shard == 0 && this->keepcomments) fprintf(this->out, "%s\n", e.name.c_str()); break;
+				case 'c': this->handle_c(e); this->ufdnames.del(e.ufd); break;
+				case 'g': this->handle_g(e); break;
+				case 'o': this->handle_o(*this->ufdnames.set(e.ufd, e.name)); break;
+				case 'u': this->handle_u(e); break;
+				case 'w': this->handle_w(e); break;
+				case 'x': this->pid = e.pid; this->exe = e.name; this->generated.clear(); this->handle_x(e); break;
+			}
+		}
+		virtual void header() {}
+
+	protected:
+		virtual void handle_o(const file_t & f) = 0;
+		virtual void handle_u(const event_t & e) = 0;
+		virtual void handle_x(const event_t & e) = 0;
+		virtual void emit_generated(const file_t & f) = 0;
+		virtual void emit_derived(const file_t & f1, const file_t & f2) = 0;
+		virtual void emit_range(const file_t & f, uint64_t off, uint64_t length,
+				const file_t & f_origin, uint64_t off_origin, uint64_t length_origin) = 0;
+
+		void handle_c(const event_t & e) {
+			const file_t *file1 = this->ufdnames.get(e.ufd);
+			auto it = this->derived.find(e.ufd);
+
+			if (file1 == NULL) {
+				fprintf(stderr, "provconv: No active mapping for ufd%u.\n", e.ufd);
+				return;
+			}
+			if (it != this->derived.end()) {
+				for (auto & f2 : it->second)
+					this->emit_derived(*file1, f2);
+				this->derived.erase(it);
+			}
+			this->generated.erase(file1->name);
+		}
+
+		void handle_g(const event_t & e) {
+			if (e.mode == 't' || e.mode == 'g') {
+				const file_t *f = this->ufdnames.find(e.name);
+				if (f == NULL)
+					fprintf(stderr, "provconv: %s is not open.\n", e.name.c_str());
+				else if (this->shard == 0)
+					this->emit_generated(*f);
+			}
+			else
+				/* do not generate triple yet - it will be generated on first write */
+				this->generated.insert(e.name);
+		}
+
+		void handle_w(const event_t & e) {
+			const file_t *file = this->ufdnames.get(e.ufd);
+			const file_t *file_origin = this->ufdnames.get(e.ufd_origin);
+
+			if (file == NULL || file_origin == NULL) {
+				fprintf(stderr, "provconv: No active mapping for ufd%u.\n",
+						file == NULL ? e.ufd : e.ufd_origin);
+				return;
+			}
+
+			/* emit generated triple if needed */
+			if (this->generated.erase(file->name))
+				this->emit_generated(*file);
+
+			/* simple file provenance */
+			this->derived[e.ufd].insert(*file_origin);
+
+			/* output ranges */
+			if (this->minrange > 0 && e.length >= this->minrange) {
+				if (e.rtype == 1)		/* SEQ */
+					this->emit_range(*file, e.off, e.length,
+							*file_origin, e.off_origin, e.length);
+				else if (e.rtype == 2)	/* REP */
+					this->emit_range(*file, e.off, e.length,
+							*file_origin, e.off_origin, 1);
+			}
+		}
+
+		FILE *out;
+		int shard;
+		int nshards;
+		uint64_t minrange;
+		bool keepcomments = true;
+		std::string exe;
+		std::string pid;
+		UFDNames ufdnames;
+		/* copies: the origin may be closed before the ufd */
+		std::map<uint32_t, std::set<file_t>> derived;
+		std::set<std::string> generated;
+};
+
+class TTLConverter : public Converter {
+	public:
+		using Converter::Converter;
+
+		void header() {
+			fprintf(this->out,
+				"@prefix prov: <http://www.w3.org/ns/prov#> .\n"
+				"@prefix rdfs: <http://www.w3.org/2000/01/rdf-schema#> .\n");
+		}
+
+	protected:
+		/* same as urllib.pathname2url() on posix */
+		static std::string quote_file(const std::string & filename) {
+			static const char hex[] = "0123456789ABCDEF";
+			std::string s("file://");
+
+			for (unsigned char c : filename) {
+				if (isalnum(c) || c == '_' || c == '.' || c == '-' || c == '/')
+					s += c;
+				else {
+					s += '%';
+					s += hex[c >> 4];
+					s += hex[c & 0xf];
+				}
+			}
+			return s;
+		}
+
+		void handle_o(const file_t & file) {
+			if (this->shard != 0)
+				return;
+			std::string f = quote_file(file.name);
+			fprintf(this->out, "<%s> a prov:Entity .\n<%s> rdfs:label \"%s\" .\n",
+					f.c_str(), f.c_str(), file.name.c_str());
+		}
+		void handle_u(const event_t & e) {
+			if (this->shard != 0)
+				return;
+			fprintf(this->out, "<%s> prov:used <%s> .\n",
+					quote_file(this->exe).c_str(),
+					quote_file(e.name).c_str());
+		}
+		void handle_x(const event_t & e) {
+			if (this->shard != 0)
+				return;
+			fprintf(this->out, "<%s> a prov:Activity .\n", quote_file(this->exe).c_str());
+		}
+		void emit_generated(const file_t & f) {
+			fprintf(this->out, "<%s> prov:wasGeneratedBy <%s> .\n",
+					quote_file(f.name).c_str(), quote_file(this->exe).c_str());
+		}
+		void emit_derived(const file_t & f1, const file_t & f2) {
+			fprintf(this->out, "<%s> prov:wasDerivedFrom <%s> .\n",
+					quote_file(f1.name).c_str(), quote_file(f2.name).c_str());
+		}
+		void emit_range(const file_t & f, uint64_t off, uint64_t length,
+				const file_t & f_origin, uint64_t off_origin, uint64_t length_origin) {
+			std::string q = quote_file(f.name), qo = quote_file(f_origin.name);
+			unsigned long long e = off + length - 1, eo = off_origin + length_origin - 1;
+
+			fprintf(this->out, "<%s> prov:hadMember <%s#%llu-%llu> .\n",
+					q.c_str(), q.c_str(), (unsigned long long)off, e);
+			fprintf(this->out, "<%s> prov:hadMember <%s#%llu-%llu> .\n",
+					qo.c_str(), qo.c_str(), (unsigned long long)off_origin, eo);
+			fprintf(this->out, "<%s#%llu-%llu> prov:wasDerivedFrom <%s#%llu-%llu> .\n",
+					q.c_str(), (unsigned long long)off, e,
+					qo.c_str(), (unsigned long long)off_origin, eo);
+		}
+};
+
+class DSLConverter : public Converter {
+	public:
+		DSLConverter(FILE *out, int shard, int nshards, uint64_t minrange, uint64_t vid_base) :
+			Converter(out, shard, nshards, minrange), vid_base(vid_base) {
+			this->keepcomments = false;
+		}
+
+	protected:
+		/*
+		 * Vertex ids. Files and processes are numbered identically in
+		 * every shard (they are derived from the broadcast events only):
+		 * files by their id, processes by the count of exec records.
+		 * Ranges get a slot of their own per shard. Range vertices are
+		 * not remembered, so a repeated range gets a new vertex.
+		 */
+		uint64_t vid(uint64_t seq, int slot) {
+			return this->vid_base + seq * (this->nshards + 1) + slot;
+		}
+		uint64_t file_vid(const file_t & f) {
+			return this->vid(2 * f.id, 0);
+		}
+
+		void handle_o(const file_t & f) {
+			if (this->shard == 0)
+				fprintf(this->out, "type:Artifact id:%llu filename:\"%s\" label:\"%s\"\n",
+						(unsigned long long)this->file_vid(f), f.name.c_str(), f.name.c_str());
+		}
+		void handle_u(const event_t & e) {
+			const file_t *f = this->ufdnames.find(e.name);
+			if (f == NULL)
+				fprintf(stderr, "provconv: %s is not open.\n", e.name.c_str());
+			else if (this->shard == 0)
+				fprintf(this->out, "type:Used from:%llu to:%llu\n",
+						(unsigned long long)this->vid_proc,
+						(unsigned long long)this->file_vid(*f));
+		}
+		void handle_x(const event_t & e) {
+			this->vid_proc = this->vid(2 * this->procs++ + 1, 0);
+			if (this->shard == 0)
+				fprintf(this->out, "type:Process id:%llu program:\"%s\" pid:%s\n",
+						(unsigned long long)this->vid_proc, this->exe.c_str(), this->pid.c_str());
+		}
+		void emit_generated(const file_t & f) {
+			fprintf(this->out, "type:WasGeneratedBy from:%llu to:%llu\n",
+					(unsigned long long)this->file_vid(f),
+					(unsigned long long)this->vid_proc);
+		}
+		void emit_derived(const file_t & f1, const file_t & f2) {
+			fprintf(this->out, "type:WasDerivedFrom from:%llu to:%llu\n",
+					(unsigned long long)this->file_vid(f1),
+					(unsigned long long)this->file_vid(f2));
+		}
+		void emit_range(const file_t & f, uint64_t off, uint64_t length,
+				const file_t & f_origin, uint64_t off_origin, uint64_t length_origin) {
+			uint64_t vo = this->vid(this->range_next++, this->shard + 1);
+			uint64_t vd = this->vid(this->range_next++, this->shard + 1);
+
+			fprintf(this->out, "type:Artifact id:%llu file:\"%s\"[%llu,%llu] memberof:%llu\n",
+					(unsigned long long)vo, f_origin.name.c_str(),
+					(unsigned long long)off_origin,
+					(unsigned long long)(off_origin + length_origin - 1),
+					(unsigned long long)this->file_vid(f_origin));
+			fprintf(this->out, "type:Artifact id:%llu file:\"%s\"[%llu,%llu] memberof:%llu\n",
+					(unsigned long long)vd, f.name.c_str(),
+					(unsigned long long)off, (unsigned long long)(off + length - 1),
+					(unsigned long long)this->file_vid(f));
+			fprintf(this->out, "type:WasDerivedFrom from:%llu to:%llu\n",
+					(unsigned long long)vo, (unsigned long long)vd);
+		}
+
+		uint64_t vid_base;
+		uint64_t vid_proc = 0;
+		uint64_t procs = 0;
+		uint64_t range_next = 0;
+};
+
+/**** sharding *****************************************************/
+typedef std::vector<event_t> batch_t;
+
+class Shard {
+	public:
+		Shard(Converter *conv) : conv(conv), done(false) {
+			this->pending.reserve(PROVCONV_BATCH);
+		}
+
+		/* called by the reader only */
+		void push(const event_t & e) {
+			this->pending.push_back(e);
+			if (this->pending.size() >= PROVCONV_BATCH)
+				this->flush();
+		}
+		void flush() {
+			std::unique_lock<std::mutex> lk(this->mtx);
+			this->not_full.wait(lk, [this]{ return this->q.size() < PROVCONV_QUEUE_MAX; });
+			this->q.push_back(batch_t());
+			this->q.back().swap(this->pending);
+			this->pending.reserve(PROVCONV_BATCH);
+			this->not_empty.notify_one();
+		}
+		void finish() {
+			this->flush();
+			std::lock_guard<std::mutex> lk(this->mtx);
+			this->done = true;
+			this->not_empty.notify_one();
+		}
+
+		/* worker thread */
+		void run() {
+			for (;;) {
+				std::unique_lock<std::mutex> lk(this->mtx);
+				this->not_empty.wait(lk, [this]{ return !this->q.empty() || this->done; });
+				if (this->q.empty())
+					return;
+				batch_t batch;
+				batch.swap(this->q.front());
+				this->q.pop_front();
+				this->not_full.notify_one();
+				lk.unlock();
+				for (auto & e : batch)
+					this->conv->process(e);
+			}
+		}
+
+		Converter *conv;
+	private:
+		std::mutex mtx;
+		std::condition_variable not_empty, not_full;
+		std::deque<batch_t> q;
+		batch_t pending;
+		bool done;
+};
+
+class Dispatcher {
+	public:
+		Dispatcher(std::vector<Converter *> & convs) {
+			if (convs.size() == 1) {
+				this->single = convs[0];
+				return;
+			}
+			this->single = NULL;
+			for (auto c : convs)
+				this->shards.push_back(new Shard(c));
+			for (auto s : this->shards)
+				this->threads.push_back(std::thread(&Shard::run, s));
+		}
+		~Dispatcher() {
+			for (auto s : this->shards)
+				delete s;
+		}
+		void operator()(const event_t & e) {
+			if (this->single != NULL)
+				this->single->process(e);
+			else if (e.op == 'w')
+				this->shards[e.ufd % this->shards.size()]->push(e);
+			else
+				for (auto s : this->shards)
+					s->push(e);
+		}
+		void finish() {
+			for (auto s : this->shards)
+				s->finish();
+			for (auto & t : this->threads)
+				t.join();
+		}
+	private:
+		Converter *single;
+		std::vector<Shard *> shards;
+		std::vector<std::thread> threads;
+};
+
+/**** input ********************************************************/
+static int parse_ufd(const char *s, uint32_t *ufd) {
+	char *end;
+
+	if (strncmp(s, "ufd", 3) != 0)
+		return -1;
+	*ufd = strtoul(s + 3, &end, 10);
+	return (end == s + 3) ? -1 : 0;
+}
+
+/* split "a:b:c" into at most n fields, the last one keeps the rest */
+static size_t split(char *s, char **f, size_t n) {
+	size_t i = 0;
+
+	f[i++] = s;
+	while (i < n && (s = strchr(s, ':')) != NULL) {
+		*s++ = '\0';
+		f[i++] = s;
+	}
+	return i;
+}
+
+static int parse_line(char *line, event_t & e) {
+	char *f[6];
+	size_t n;
+
+	e.op = line[0];
+	if (e.op == '#') {
+		e.name = line;
+		return 0;
+	}
+	if (line[1] != ':')
+		return -1;
+	line += 2;
+	switch (e.op) {
+		case 'c':
+			return parse_ufd(line, &e.ufd);
+		case 'g':
+			if (split(line, f, 3) != 3)
+				return -1;
+			e.mode = f[0][0];
+			e.name = f[2];
+			return 0;
+		case 'o':
+			if (split(line, f, 2) != 2)
+				return -1;
+			e.name = f[1];
+			return parse_ufd(f[0], &e.ufd);
+		case 'u':
+			if (split(line, f, 2) != 2)
+				return -1;
+			e.name = f[1];
+			return 0;
+		case 'w':
+			if ((n = split(line, f, 6)) != 6)
+				return -1;
+			for (e.rtype = 0; e.rtype < 3; e.rtype++)
+				if (strcmp(f[0], range_types[e.rtype]) == 0)
+					break;
+			if (e.rtype == 3)
+				return -1;
+			e.off = strtoull(f[2], NULL, 10);
+			e.off_origin = strtoull(f[4], NULL, 10);
+			e.length = strtoull(f[5], NULL, 10);
+			if (parse_ufd(f[1], &e.ufd) || parse_ufd(f[3], &e.ufd_origin))
+				return -1;
+			return 0;
+		case 'x':
+			if (split(line, f, 2) != 2)
+				return -1;
+			e.pid = f[0];
+			e.name = f[1];
+			return 0;
+	}
+	return -1;
+}
+
+static void read_text(FILE *in, const char *fname, Dispatcher & dispatch) {
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	unsigned long lineno = 0;
+	event_t e;
+
+	while ((len = getline(&line, &cap, in)) != -1) {
+		lineno++;
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (parse_line(line, e) != 0) {
+			fprintf(stderr, "provconv: %s:%lu: bad line skipped\n", fname, lineno);
+			continue;
+		}
+		dispatch(e);
+	}
+	free(line);
+}
+
+/* the open record expands into the o/u/g lines of PROVLOG::open() */
+static void read_binary(FILE *in, const char *fname, Dispatcher & dispatch) {
+	std::vector<char> buf(UINT16_MAX + 1);
+	provbin_rec_t rec;
+	std::string exe("N/A");
+	event_t e;
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		size_t plen = rec.size - sizeof(rec);
+		const char *p = buf.data();
+
+		if (rec.size < sizeof(rec) || fread(buf.data(), 1, plen, in) != plen) {
+			fprintf(stderr, "provconv: %s: truncated record\n", fname);
+			return;
+		}
+		e.op = rec.type;
+		switch (rec.type) {
+			case 'o': {
+				provbin_open_t o;
+				memcpy(&o, p, sizeof(o));
+				std::string fdname(p + sizeof(o), o.namelen);
+
+				e.ufd = rec.ufd;
+				e.name = fdname;
+				dispatch(e);
+				if (!(o.flags & O_WRONLY)) {
+					e.op = 'u';
+					dispatch(e);
+				}
+				if (o.flags & (O_WRONLY|O_RDWR)) {
+					e.op = '#';
+					e.name = rec.sub ? "#g:created" : (o.flags & O_TRUNC) ? "#g:truncated" : "#g:updated";
+					dispatch(e);
+					e.op = 'g';
+					e.mode = rec.sub ? 'c' : (o.flags & O_TRUNC) ? 't' : 'u';
+					e.name = fdname;
+					dispatch(e);
+				}
+				break;
+			}
+			case 'c':
+				e.ufd = rec.ufd;
+				dispatch(e);
+				break;
+			case 'x': {
+				provbin_name_t x;
+				memcpy(&x, p, sizeof(x));
+				e.pid = std::to_string(rec.ufd);
+				e.name.assign(p + sizeof(x), x.namelen);
+				dispatch(e);
+				break;
+			}
+			case 'w': {
+				provbin_write_t w;
+				memcpy(&w, p, sizeof(w));
+				e.rtype = rec.sub < 3 ? rec.sub : 0;
+				e.ufd = rec.ufd;
+				e.ufd_origin = w.ufd_origin;
+				e.off = w.off_dest;
+				e.off_origin = w.off_origin;
+				e.length = w.length;
+				dispatch(e);
+				break;
+			}
+			default:
+				fprintf(stderr, "provconv: %s: unknown record type %d\n", fname, rec.type);
+				return;
+		}
+	}
+}
+
+static void convert(FILE *in, const char *fname, Dispatcher & dispatch) {
+	provbin_hdr_t hdr;
+	int c = fgetc(in);
+
+	/* text lines never start with the first byte of the magic */
+	if (c != PROVBIN_MAGIC[0]) {
+		if (c != EOF)
+			ungetc(c, in);
+		read_text(in, fname, dispatch);
+		return;
+	}
+	hdr.magic[0] = c;
+	if (fread(hdr.magic + 1, 1, sizeof(hdr) - 1, in) != sizeof(hdr) - 1 ||
+			memcmp(hdr.magic, PROVBIN_MAGIC, sizeof(hdr.magic)) != 0) {
+		fprintf(stderr, "provconv: %s: not a raw provenance log\n", fname);
+		return;
+	}
+	if (hdr.version != PROVBIN_VERSION) {
+		fprintf(stderr, "provconv: %s: unsupported version %u\n", fname, hdr.version);
+		return;
+	}
+	read_binary(in, fname, dispatch);
+}
+
+/**** main *********************************************************/
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [-f ttl|dsl] [-minrange N] [-j N -o out] [file ...]\n"
+		"Convert DataTracker raw (text or binary) provenance to PROV/Turtle or SPADE DSL.\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	std::string fmt("ttl"), outname;
+	uint64_t minrange = 0;
+	int nshards = 1, i;
+	std::vector<Converter *> convs;
+	std::vector<FILE *> outs;
+	char ts[32];
+	time_t now = time(NULL);
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		if (strcmp(argv[i], "-f") == 0)
+			fmt = argv[++i];
+		else if (strcmp(argv[i], "-minrange") == 0)
+			minrange = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-j") == 0)
+			nshards = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0)
+			outname = argv[++i];
+		else
+			usage(argv[0]);
+	}
+	if ((fmt != "ttl" && fmt != "dsl") || nshards < 1 || (nshards > 1 && outname.empty()))
+		usage(argv[0]);
+
+	/* same vertex id base as raw2dsl.py, e.g. 201504141812190000 */
+	strftime(ts, sizeof(ts), "%Y%m%d%H%M%S", gmtime(&now));
+
+	for (int s = 0; s < nshards; s++) {
+		FILE *out = stdout;
+		if (!outname.empty()) {
+			std::string fn = nshards > 1 ? outname + "." + std::to_string(s) : outname;
+			if ((out = fopen(fn.c_str(), "w")) == NULL) {
+				perror(fn.c_str());
+				return 1;
+			}
+		}
+		outs.push_back(out);
+		if (fmt == "ttl")
+			convs.push_back(new TTLConverter(out, s, nshards, minrange));
+		else
+			convs.push_back(new DSLConverter(out, s, nshards, minrange,
+					strtoull(ts, NULL, 10) * 10000));
+		convs.back()->header();
+	}
+
+	Dispatcher dispatch(convs);
+	if (i == argc)
+		convert(stdin, "<stdin>", dispatch);
+	for (; i < argc; i++) {
+		FILE *in = strcmp(argv[i], "-") ? fopen(argv[i], "rb") : stdin;
+		if (in == NULL) {
+			perror(argv[i]);
+			continue;
+		}
+		convert(in, argv[i], dispatch);
+		if (in != stdin)
+			fclose(in);
+	}
+	dispatch.finish();
+
+	for (auto out : outs)
+		fclose(out);
+	for (auto c : convs)
+		delete c;
+	return 0;
+}
+
+/* vim: set noet ts=4 sts=4 sw=4 ai : */
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "provlog.H"
 
 /* Array that maps fds to ufds. Unlike fds which are recycled, ufds
@@ -18,6 +20,66 @@ off_t stdcount[STDFD_MAX];
 /* Raw provenance output stream. */
 std::ofstream PROVLOG::rawProvStream;
 
+/* Binary raw provenance: format switch and block buffer. */
+int PROVLOG::binary = 0;
+static char provbin_block[PROVBIN_BLOCK_SZ];
+static size_t provbin_used = 0;
+
+void PROVLOG::flush(void) {
+	if (provbin_used > 0) {
+		rawProvStream.write(provbin_block, provbin_used);
+		provbin_used = 0;
+	}
+	rawProvStream.flush();
+}
+
+/* Write the file header; the stream must be empty. */
+void PROVLOG::bin_begin(void) {
+	provbin_hdr_t hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PROVBIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = PROVBIN_VERSION;
+	memcpy(provbin_block, &hdr, sizeof(hdr));
+	provbin_used = sizeof(hdr);
+	binary = 1;
+}
+
+/* Stage a record in the block buffer; the block is written when full. */
+void PROVLOG::bin_record(const UINT8 type, const UINT8 sub, const UINT32 ufd,
+		const void *payload, const size_t plen, const std::string *name) {
+	size_t nlen = name ? MIN(name->size(), (size_t)PROVBIN_NAME_MAX) : 0;
+	size_t size = sizeof(provbin_rec_t) + plen + nlen;
+	UINT32 namelen = nlen;
+	provbin_rec_t rec;
+	char *p;
+
+	size = (size + PROVBIN_ALIGN - 1) & ~(size_t)(PROVBIN_ALIGN - 1);
+	if (provbin_used + size > PROVBIN_BLOCK_SZ) {
+		rawProvStream.write(provbin_block, provbin_used);
+		provbin_used = 0;
+	}
+
+	rec.type = type;
+	rec.sub = sub;
+	rec.size = size;
+	rec.ufd = ufd;
+	p = provbin_block + provbin_used;
+	memset(p, 0, size);
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	if (plen > 0) {
+		memcpy(p, payload, plen);
+		/* every named payload ends with its name length */
+		if (name)
+			memcpy(p + plen - sizeof(namelen), &namelen, sizeof(namelen));
+		p += plen;
+	}
+	if (nlen > 0)
+		memcpy(p, name->data(), nlen);
+	provbin_used += size;
+}
+
 /* Current executable name and pid.
  * XXX: Check if this works correctly while following execv().
  */
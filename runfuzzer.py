@@ -20,16 +20,17 @@ import binascii as bina
 import copy
 import re
 import hashlib
+import struct
+import array
 
 
 import gautils as gau
 import mmap
+import ctypes
 import BitVector as BV
 import argparse
 
 #config.MOSTCOMFLAG=False # this is set once we compute taint for initial inputs.
-libfd=open("image.offset","r+b")
-libfd_mm=mmap.mmap(libfd.fileno(),0)
 
 def get_min_file(src):
     files=os.listdir(src)
@@ -50,11 +51,6 @@ def check_env():
     ''' this function checks relevant environment variable that must be set before we stat our fuzzer..'''
     if os.getenv('PIN_ROOT') == None:
         gau.die("PIN_ROOT env is not set. Run export PIN_ROOT=path_to_pin_exe")
-    fd1=open("/proc/sys/kernel/randomize_va_space",'r')
-    b=fd1.read(1)
-    fd1.close()
-    if int(b) != 0:
-        gau.die("ASLR is not disabled. Run: echo 0 | sudo tee /proc/sys/kernel/randomize_va_space")
     fd=open("/proc/sys/kernel/yama/ptrace_scope",'r')
     b=fd.read(1)
     fd.close()
@@ -73,7 +69,36 @@ def sha1OfFile(filepath):
     with open(filepath, 'rb') as f:
         return hashlib.sha1(f.read()).hexdigest()
 
+def crash_bucket(retc):
+    ''' reads the crash bucket ID ("signal:hash" of the innermost frames, or of the faulting PC under bbtrap) written by bbcounts2 or bbtrap and removes the file, so that a crash the pintool did not catch is not counted in the bucket of the previous one. Such crashes get one bucket per exit code.'''
+    try:
+        with open(config.CRASHFILE,'r') as f:
+            bucket=f.readline().strip()
+        os.remove(config.CRASHFILE)
+    except (IOError, OSError):
+        bucket=''
+    if bucket == '':
+        bucket="%d:unknown"%(-retc,)
+    return bucket
+
+def bbdict_bin(fn):
+    ''' reads the binary output of bbcounts2 (-binout 1): "BBC1", count, address size, then the sorted addresses and their log2 buckets. The frequency returned for a bucket b is 2**b-1, so that fitness computes log2(freq+1) = b again.'''
+    with open(fn,"rb") as bbFD:
+        data=bbFD.read()
+    if len(data) < 12 or data[:4] != "BBC1":
+        return {}
+    num,asz=struct.unpack_from('II',data,4)
+    if asz == 8:
+        adrs=struct.unpack_from('=%dQ'%(num,),data,12)
+    else:
+        adrs=array.array('I')
+        adrs.fromstring(data[12:12+num*asz])
+    bkts=bytearray(data[12+num*asz:12+num*asz+num])
+    return dict((adr,(1<<b)-1) for adr,b in zip(adrs,bkts))
+
 def bbdict(fn):
+    if config.BBBINARY == True:
+        return bbdict_bin(fn)
     with open(config.BBOUT,"r") as bbFD:
        bb = {}
        for ln in bbFD:
@@ -131,28 +156,292 @@ def calculate_error_bb():
     del tt
     del tbv
 
-def execute(tfl):
+EDGE_MAP_SIZE=65536 # must match bbcounts2.cpp
+EDGEMM=None # mmap of config.EDGEMAP
+# AFL-style hit count classes of an edge (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)
+EDGECLASS=[0,1,2,3]+[4]*4+[5]*8+[6]*16+[7]*96+[8]*128
+
+def open_edgemap():
+    ''' creates the edge hitmap file shared with bbcounts2 and adds it to config.PINCMD.'''
+    global EDGEMM
+    fd=os.open(config.EDGEMAP,os.O_RDWR|os.O_CREAT,0600)
+    os.ftruncate(fd,EDGE_MAP_SIZE)
+    EDGEMM=mmap.mmap(fd,EDGE_MAP_SIZE)
+    os.close(fd)
+    config.PINCMD[-1:-1]=["-edgemap",config.EDGEMAP]
+
+def read_edges():
+    ''' returns the set of (edge, hit count class) of the last execution.'''
+    hits=bytearray(EDGEMM[:])
+    return set((i,EDGECLASS[c]) for i,c in enumerate(hits) if c)
+
+FORKSRV_FD=198 # must match bbcounts2.cpp and dtracker.cpp
+FSERVER=None # (proc, ctl fd, status fd, input path, shared input map) of the running fork server
+TSERVER=None # the same for the dtracker fork server
+
+INFD=None # memfd that holds the input of the next run (config.MEMFDINPUT)
+
+def open_memfd():
+    ''' creates the memfd through which inputs are passed (config.MEMFDINPUT). The SUT opens it as /proc/self/fd/N, so it is not close-on-exec. Returns False if memfd_create(2) is not available.'''
+    global INFD
+    libc=ctypes.CDLL(None,use_errno=True)
+    try:
+        fd=libc.memfd_create("vuzzer-input",0)
+    except AttributeError:
+        # no libc wrapper: raw syscall, x86 numbers
+        fd=libc.syscall(356 if struct.calcsize('P') == 4 else 319,"vuzzer-input",0)
+    if fd < 0:
+        return False
+    INFD=fd
+    return True
+
+def memfd_path():
+    return "/proc/self/fd/%d"%(INFD,)
+
+def put_input(tfl,path):
+    ''' makes tfl the input at path: its bytes are written to the memfd if path is the memfd, else the file is copied.'''
+    if INFD is None or path != memfd_path():
+        shutil.copyfile(tfl,path)
+        return
+    with open(tfl,'rb') as f:
+        data=f.read()
+    os.ftruncate(INFD,0)
+    os.lseek(INFD,0,os.SEEK_SET)
+    while data:
+        data=data[os.write(INFD,data):]
+
+def input_path(tfl):
+    ''' the path of input tfl on the SUT command line: the memfd, filled with tfl, or tfl itself.'''
+    if INFD is None:
+        return tfl
+    put_input(tfl,memfd_path())
+    return memfd_path()
+
+def pintnt_cmd(name):
+    ''' config.PINTNTCMD for the input called name. With the memfd, dtracker recognizes the input by identity instead (-inputfd).'''
+    pargs=config.PINTNTCMD[:]
+    pargs[pargs.index("inputf")]=name
+    if INFD is not None:
+        pargs[-1:-1]=["-inputfd",str(INFD)]
+    return pargs
+
+def spawn_server(runcmd,fsin,shm=None):
+    ''' starts a fork server (bbcounts2 or dtracker) with its request/reply pipes on FORKSRV_FD and FORKSRV_FD+1. Returns (proc, ctl fd, status fd, fsin, shm) once it said hello, or None. If shm is given, inputs are passed in it instead of fsin (dtracker -shminput).'''
+    ctlr,ctlw=os.pipe()
+    stfd,stw=os.pipe()
+    def setfds():
+        os.dup2(ctlr,FORKSRV_FD)
+        os.dup2(stw,FORKSRV_FD+1)
+        for fd in (ctlr,ctlw,stfd,stw):
+            os.close(fd)
+    print "[*] Starting fork server ", runcmd
+    devnull=open(os.devnull,'w')
+    proc=subprocess.Popen(runcmd, stdout=devnull, stderr=devnull, preexec_fn=setfds)
+    devnull.close()
+    os.close(ctlr)
+    os.close(stw)
+    if len(os.read(stfd,4)) != 4:
+        os.close(ctlw)
+        os.close(stfd)
+        proc.wait()
+        if shm is not None:
+            shm.close()
+        return None
+    return (proc,ctlw,stfd,fsin,shm)
+
+def close_server(server):
+    proc,ctlw,stfd,fsin,shm=server
+    os.close(ctlw)
+    os.close(stfd)
+    if shm is not None:
+        shm.close()
+    return proc.wait()
+
+def serve(server,tfl):
+    ''' runs one input through a fork server; returns the wait status of the child, or None if the server is gone.'''
+    proc,ctlw,stfd,fsin,shm=server
+    if shm is None:
+        put_input(tfl,fsin)
+    else:
+        with open(tfl,'rb') as f:
+            data=f.read(len(shm)-4)
+        shm[4:4+len(data)]=data
+        shm[0:4]=struct.pack('I',len(data))
+    try:
+        os.write(ctlw,struct.pack('I',0))
+        rep=os.read(stfd,8)
+        if len(rep) == 4: # bbcounts2 writes the pid and the status separately
+            rep+=os.read(stfd,4)
+    except OSError:
+        rep=''
+    if len(rep) != 8:
+        return None
+    pid,status=struct.unpack('Ii',rep)
+    return status
+
+def wait_code(status):
+    ''' exit code of a wait status, like run() returns it (negative signal number if killed).'''
+    if os.WIFSIGNALED(status):
+        return -os.WTERMSIG(status)
+    return os.WEXITSTATUS(status)
+
+def start_forkserver(tfl):
+    ''' starts bbcounts2 with -forkserver. Pin and the SUT are set up once and stop at the entry point; every request then forks a child that runs the SUT on config.FSINPUT (plus the extension of tfl).'''
+    global FSERVER
+    fsin=memfd_path() if INFD is not None else config.FSINPUT+os.path.splitext(tfl)[1]
+    put_input(tfl,fsin)
+    if config.PERSISTFN != '':
+        fsargs=["-persist_fn",config.PERSISTFN,"-persist_iters",str(config.PERSISTITERS)]
+        if config.PERSISTBUF >= 0:
+            fsargs+=["-persist_buf",str(config.PERSISTBUF),"-persist_len",str(config.PERSISTLEN),"-persist_max",str(config.PERSISTMAX),"-persist_input",fsin]
+    else:
+        fsargs=["-forkserver","1"]
+    runcmd=config.PINCMD[:-1]+fsargs+["--"]+(config.SUT % fsin).split(' ')
+    FSERVER=spawn_server(runcmd,fsin)
+    return FSERVER is not None
+
+def stop_forkserver():
+    global FSERVER
+    if FSERVER is None:
+        return 0
+    server=FSERVER
+    FSERVER=None
+    return close_server(server)
+
+def run_forkserver(tfl):
+    ''' runs one input through the fork server; returns the exit code like run() does (negative signal number if killed), or None if the server is gone. In persistent mode a crash takes the server down, so its exit code is the result.'''
+    status=serve(FSERVER,tfl)
+    if status is None:
+        retc=stop_forkserver()
+        if config.PERSISTFN != '' and retc < 0:
+            return retc
+        return None
+    return wait_code(status)
+
+def start_taintserver(tfl):
+    ''' starts dtracker with -forkserver. Pin, libdft and the SUT run once up to the first open() of config.TNTINPUT (plus the extension of tfl); every request then forks a child that continues from there.'''
+    global TSERVER
+    fsin=memfd_path() if INFD is not None else config.TNTINPUT+os.path.splitext(tfl)[1]
+    put_input(tfl,fsin)
+    pargs=pintnt_cmd(os.path.basename(fsin))
+    shm=None
+    if config.SHMINPUT != '':
+        # 4-byte length, then up to SHMINMAX bytes of input
+        fd=os.open(config.SHMINPUT,os.O_RDWR|os.O_CREAT,0600)
+        os.ftruncate(fd,4+config.SHMINMAX)
+        shm=mmap.mmap(fd,4+config.SHMINMAX)
+        os.close(fd)
+        pargs[-1:-1]=["-shminput",config.SHMINPUT]
+    runcmd=pargs[:-1]+["-forkserver","1","--"]+(config.SUT % fsin).split(' ')
+    TSERVER=spawn_server(runcmd,fsin,shm)
+    return TSERVER is not None
+
+def stop_taintserver():
+    global TSERVER
+    if TSERVER is None:
+        return 0
+    server=TSERVER
+    TSERVER=None
+    return close_server(server)
+
+def read_fitness():
+    ''' reads the fitness sums written by bbcounts2 (-weights), see gautils.fitnesTool.'''
+    try:
+        with open(config.FITOUT,"r") as fitFD:
+            sums=fitFD.readline().split()
+            fresh=[int(ad,0) for ad in fitFD.readline().split()]
+    except IOError:
+        return None
+    if len(sums) != 5:
+        return None
+    return (float(sums[0]),int(sums[1]),int(sums[2]),int(sums[3]),int(sums[4]),fresh)
+
+def read_newbb():
+    ''' reads the BBs that bbcounts2 saw for the first time in this fuzzing session (-seen).'''
+    try:
+        with open(config.NEWBBOUT,"r") as nFD:
+            num=int(nFD.readline())
+            fresh=[int(ad,0) for ad in nFD.readline().split()]
+    except (IOError,ValueError):
+        return None
+    if len(fresh) != num:
+        return None
+    return fresh
+
+def read_cost():
+    ''' reads the cost of the last run written by bbcounts2 (-cost): (blocks, instructions, syscalls, peak RSS in KB, wall time in ms).'''
+    try:
+        with open(config.COSTOUT,"r") as cFD:
+            cost=tuple(int(v) for v in cFD.readline().split())
+    except (IOError,ValueError):
+        return None
+    if len(cost) != 5:
+        return None
+    return cost
+
+def execute(tfl,bbneeded=True,once=False):
+    ''' runs tfl under bbcounts2; the BB dictionary is not read if bbneeded is False and the tool already computed the fitness (config.TOOLFITNESS). If once is True, only the set of executed BBs is needed: bbcounts2 then runs with -once (all frequencies are 1), unless a fork server is used.'''
     bbs={}
-    args=config.SUT % tfl
-    runcmd=config.PINCMD+args.split(' ')
+    args=config.SUT % input_path(tfl)
+    once = once and config.COVONCE == True and config.FORKSERVER == False and config.PERSISTFN == ''
+    if once:
+        runcmd=config.PINCMD[:-1]+["-once","1","--"]+args.split(' ')
+    elif config.TAINTCOV == True:
+        # one dtracker run gives the BBs and, if the input finds new BBs, its taint (without the compares before the first new BB)
+        pargs=pintnt_cmd(os.path.basename(tfl))
+        runcmd=pargs[:-1]+["-bbout",config.BBOUT,"-bblibs",config.LIBTOMONITOR,"-taint","2","-seen",config.SEENMAP,"-newbb",config.NEWBBOUT,"--"]+args.split(' ')
+    else:
+        runcmd=config.PINCMD+args.split(' ')
     try:
         os.unlink(config.BBOUT)
     except:
         pass
-    retc = run(runcmd)
-    #check if loading address was changed
-    #liboffsetprev=int(config.LIBOFFSETS[1],0)
-    if config.LIBNUM == 2:
-        if config.BIT64 == False:
-            liboffsetcur=int(libfd_mm[:10],0)
-        else:
-            liboffsetcur=int(libfd_mm[:],0)
-        libfd_mm.seek(0)
-        if liboffsetcur != int(config.LIBOFFSETS[1],0):
-            #print "Load address changed!"
-            gau.die("load address changed..run again!")
+    if config.TOOLFITNESS == True:
+        try:
+            os.unlink(config.FITOUT)
+        except:
+            pass
+    if config.SEENMAP != '':
+        try:
+            os.unlink(config.NEWBBOUT)
+        except:
+            pass
+    if config.COSTOUT != '':
+        try:
+            os.unlink(config.COSTOUT)
+        except:
+            pass
+    retc=None
+    # a persistent server exits after PERSISTITERS inputs, so restart it once
+    for i in range(2):
+        if config.FORKSERVER == False and config.PERSISTFN == '':
+            break
+        if FSERVER is None and not start_forkserver(tfl):
+            print "[*] Fork server did not start, running pin for each input."
+            config.FORKSERVER=False
+            config.PERSISTFN=''
+            break
+        retc = run_forkserver(tfl)
+        if retc is not None:
+            break
+    if retc is None:
+        retc = run(runcmd)
+    if config.TOOLFITNESS == True:
+        config.LASTFIT=read_fitness()
+    if config.SEENMAP != '':
+        config.LASTNEW=read_newbb()
+    if config.COSTOUT != '':
+        config.LASTCOST=read_cost()
+    if config.TAINTCOV == True and not once and config.LASTNEW and retc != 255:
+        fl=os.path.basename(tfl)
+        config.TAINTMAP[fl]=read_taint(tfl)
+        config.LEAMAP[fl]=read_lea()
+        config.PATCHMAP[fl]=read_patch(os.path.getsize(tfl))
     # open BB trace file to get BBs
-    bbs = bbdict(config.BBOUT)
+    if bbneeded or config.TOOLFITNESS == False or config.LASTFIT is None:
+        bbs = bbdict(config.BBOUT)
+    if EDGEMM is not None:
+        config.LASTEDGES=read_edges()
     if config.CLEANOUT == True:
         gau.delete_out_file(tfl)
     return (bbs,retc)
@@ -178,9 +467,18 @@ def isNonPrintable(hexstr):
         return False
 
 def execute2(tfl,fl):
-    args=config.SUT % tfl
-    pargs=config.PINTNTCMD[:]
-    pargs[pargs.index("inputf")]=fl
+    if config.TAINTFORKSERVER == True:
+        for i in range(2):
+            if TSERVER is None and not start_taintserver(tfl):
+                print "[*] dtracker fork server did not start, running pin for each input."
+                config.TAINTFORKSERVER=False
+                break
+            status=serve(TSERVER,tfl)
+            if status is not None:
+                return wait_code(status)
+            stop_taintserver()
+    args=config.SUT % input_path(tfl)
+    pargs=pintnt_cmd(fl)
     runcmd=pargs+args.split(' ')
     #print "[*] Executing: ",runcmd 
     retc = run(runcmd)
@@ -235,6 +533,53 @@ def read_lea():
     return offsets.copy()
 
 
+def read_token(fsize):
+    '''
+    we also read token.out file, which has byte-wise compares (strcmp, memcmp loops) already joined into multi-byte tokens. Each line is "ins_addr start_offset len hexbytes" and the bytes are in input order.'''
+    offsets=dict()
+    if not os.path.isfile("token.out"):
+        return offsets
+    tokFD=open("token.out","r")
+    pat=re.compile(r"(\w+) (\d+) (\d+) ([0-9a-f]+)",re.I)
+    for ln in tokFD:
+        mat=pat.match(ln)
+        if mat is None:
+            continue
+        ofs=int(mat.group(2))
+        if ofs>fsize-config.MINOFFSET:
+            ofs=ofs-fsize
+        hexstr=bina.unhexlify(mat.group(4))
+        if ofs not in offsets:
+            offsets[ofs]=[hexstr]
+        elif hexstr not in offsets[ofs]:
+            offsets[ofs].append(hexstr)
+    tokFD.close()
+    return offsets
+
+
+def read_patch(fsize):
+    '''
+    we also read patch.out file, which has input-to-state patches written by the compare handlers. Each line is "ins_addr kind off:xx,off:xx,..." and the bytes are already in input order, so they are applied as they are. Returns a list of patches, each a list of (offset, byte) tuples.'''
+    patches=set()
+    if not os.path.isfile("patch.out"):
+        return []
+    patFD=open("patch.out","r")
+    for i,ln in enumerate(patFD):
+        if i >= config.MAXFILELINE:
+            break
+        fields=ln.split()
+        if len(fields) != 3:
+            continue
+        patch=[]
+        for ob in fields[2].split(','):
+            ofs,byte=ob.split(':')
+            ofs=int(ofs)
+            if ofs>fsize-config.MINOFFSET:
+                ofs=ofs-fsize
+            patch.append((ofs,chr(int(byte,16))))
+        patches.add(tuple(patch))
+    patFD.close()
+    return list(patches)
 
 
 def read_taint(fpath):
@@ -373,6 +718,9 @@ def read_taint(fpath):
         alltaintoff.remove(el)
         #print '*',el
         alltaintoff.add(el-fsize)
+    # whole tokens go last: the mutators take the last value of an offset as the intended one.
+    for ofs,toks in read_token(fsize).iteritems():
+        taintOff[ofs]=taintOff.get(ofs,[])+toks
 
     #alltaintoff.difference_update(taintOff)
     #print alltaintoff, taintOff
@@ -397,6 +745,7 @@ def get_taint(dirin):
             gau.die("pintool terminated with error 255 on input %s"%(pfl,))
         config.TAINTMAP[fl]=read_taint(pfl)
         config.LEAMAP[fl]=read_lea()
+        config.PATCHMAP[fl]=read_patch(os.path.getsize(pfl))
         #print config.TAINTMAP[fl][1]
         #raw_input("press key..")
     if config.MOSTCOMFLAG==False:
@@ -472,7 +821,7 @@ def dry_run():
             f.close()
         except:
             gau.die("can not open our own input %s!"%(tfl,))
-        (bbs,retc)=execute(tfl)
+        (bbs,retc)=execute(tfl,once=True)
         if retc < 0:
             gau.die("looks like we already got a crash!!")
         config.GOODBB |= set(bbs.keys())
@@ -492,7 +841,7 @@ def dry_run():
         dfiles=os.listdir(config.INPUTD)
         for fl in dfiles:
             tfl=os.path.join(config.INPUTD,fl)
-            (bbs,retc)=execute(tfl)
+            (bbs,retc)=execute(tfl,once=True)
             if retc < 0:
                 gau.die("looks like we already got a crash!!")
             tempbad.append(set(bbs.keys()) - config.GOODBB)
@@ -511,12 +860,11 @@ def dry_run():
         print "error bb: 0x%x"%(ebb,)
     time.sleep(5)
     if config.LIBNUM == 2:
-        baseadr=config.LIBOFFSETS[1]
         for ele in tempcomn:
-            if ele < baseadr:
+            if gau.bbModule(ele) == 0:
                 config.ERRORBBAPP.add(ele)
             else:
-                config.ERRORBBLIB.add(ele-baseadr)
+                config.ERRORBBLIB.add(gau.bbOffset(ele))
                          
     del tempbad
     del badbb
@@ -528,12 +876,15 @@ def run_error_bb(pt):
     files = os.listdir(config.INPUTD)
     for fl in files:
         tfl=os.path.join(config.INPUTD,fl)
-        (bbs,retc)=execute(tfl)
+        (bbs,retc)=execute(tfl,once=True)
         #if retc < 0:
         #    print "[*] crashed while executing %s"%(fl,)
         #    gau.die("Bye...")
         form_bitvector(bbs)
     calculate_error_bb()
+    if config.TOOLFITNESS == True:
+        gau.writeErrorBB()
+        stop_forkserver()
 def copy_files(src, dest,num):
         files =random.sample(os.listdir(src),num)
         for fl in files:
@@ -553,7 +904,12 @@ def conditional_copy_files(src, dest,num):
             shutil.copy(tfl,dest)
         return 0
     else:
-        tlist=random.sample(list(extra),num)
+        # inputs that found globally new BBs (see config.SEENMAP) go first
+        novel=[fl for fl in extra if fl in config.NOVELIN]
+        if len(novel)>=num:
+            tlist=random.sample(novel,num)
+        else:
+            tlist=novel+random.sample(list(extra-set(novel)),num-len(novel))
         for fl in tlist:
             tfl=os.path.join(src,fl)
             shutil.copy(tfl,dest)
@@ -577,7 +933,7 @@ def main():
     parser.add_argument('-w','--weight', help='path of the pickle file(s) for BB wieghts (separated by comma, in case there are two) ',required=True)
     parser.add_argument('-n','--name', help='Path of the pickle file(s) containing strings from CMP inst (separated by comma if there are two).',required=True)
     parser.add_argument('-l','--libnum', help='Nunber of binaries to monitor (only application or used libraries)',required=False, default=1)
-    parser.add_argument('-o','--offsets',help='base-address of application and library (if used), separated by comma', required=False, default='0x00000000')
+    parser.add_argument('-o','--offsets',help='unused: BBs are identified by binary and offset, whatever the load address', required=False, default='0x00000000')
     parser.add_argument('-b','--libname',help='library name to monitor',required=False, default='')
     args = parser.parse_args()
     config.SUT=args.sut
@@ -586,7 +942,6 @@ def main():
     config.LIBTOMONITOR=args.libname
     config.LIBPICKLE=[w for w in args.weight.split(',')]
     config.NAMESPICKLE=[n for n in args.name.split(',')]
-    config.LIBOFFSETS=[o for o in args.offsets.split(',')]
 
 
     ###################################
@@ -608,6 +963,48 @@ def main():
     except OSError:
         gau.emptyDir("outd/crashInputs")
 
+    if config.MEMFDINPUT == True and not open_memfd():
+        print "[*] memfd_create is not available, inputs are passed as files."
+    if config.TAINTREPLAY > 0:
+        if config.TAINTFORKSERVER == True:
+            print "[*] TAINTREPLAY is not used with TAINTFORKSERVER."
+        else:
+            config.PINTNTCMD[-1:-1]=["-replay",str(config.TAINTREPLAY)]
+    if config.TAINTDETACH == True:
+        config.PINTNTCMD[-1:-1]=["-autodetach","1"]
+    if config.MAXCMP > 0:
+        config.PINTNTCMD[-1:-1]=["-maxcmp",str(config.MAXCMP)]
+    if config.TRAPCOV == True:
+        print "[*] TRAPCOV: using bbtrap, without PERSISTFN, TOOLFITNESS, BBBINARY, EDGEMAP, COSTOUT and TAINTCOV."
+        config.PERSISTFN=''
+        config.TOOLFITNESS=False
+        config.BBBINARY=False
+        config.EDGEMAP=''
+        config.COSTOUT=''
+        config.TAINTCOV=False
+        config.PINCMD=[config.BBTRAP,"-blocks",config.BLOCKLIST,"-o",config.BBOUT,"-x",str(config.TIMEOUT),"-libc","0","-l",config.LIBTOMONITOR,"--"]
+    if config.TAINTCOV == True:
+        if config.SEENMAP == '':
+            gau.die("TAINTCOV needs SEENMAP")
+        if config.FORKSERVER == True or config.PERSISTFN != '' or config.TOOLFITNESS == True or config.BBBINARY == True:
+            print "[*] TAINTCOV: turning off FORKSERVER, PERSISTFN, TOOLFITNESS and BBBINARY."
+            config.FORKSERVER=False
+            config.PERSISTFN=''
+            config.TOOLFITNESS=False
+            config.BBBINARY=False
+    if config.EDGEMAP != '':
+        open_edgemap()
+    if config.BBBINARY == True:
+        config.PINCMD[-1:-1]=["-binout","1"]
+    if config.SEENMAP != '':
+        try:
+            os.unlink(config.SEENMAP)
+        except OSError:
+            pass
+        config.PINCMD[-1:-1]=["-seen",config.SEENMAP,"-newbb",config.NEWBBOUT]
+    if config.COSTOUT != '':
+        config.PINCMD[-1:-1]=["-cost",config.COSTOUT]
+
     crashHash=[]
     try:
         os.mkdir(config.SPECIAL)
@@ -621,12 +1018,21 @@ def main():
    
     ###### open names pickle files
     gau.prepareBBOffsets()
+    if config.TRAPCOV == True:
+        gau.writeBlockList()
+    if config.TOOLFITNESS == True:
+        gau.writeWeights()
+        gau.writeErrorBB()
+        config.PINCMD[-1:-1]=["-weights",config.WEIGHTFILE,"-errorbb",config.ERRORBBFILE,"-fitness",config.FITOUT]
     if config.PTMODE:
         pt = simplept.simplept()
     else:
         pt = None
     if config.ERRORBBON==True:
         gbb,bbb=dry_run()
+        if config.TOOLFITNESS == True:
+            gau.writeErrorBB()
+            stop_forkserver()
     else:
         gbb=0
    # gau.die("dry run over..")
@@ -642,7 +1048,7 @@ def main():
     stat.write("**** Initial BB for seed inputs: %d ****\n"%(gbb,))
     stat.flush()
     os.fsync(stat.fileno())
-    stat.write("Genaration\t MINfit\t MAXfit\t AVGfit MINlen\t Maxlen\t AVGlen\t #BB\t AppCov\t AllCov\n")
+    stat.write("Genaration\t MINfit\t MAXfit\t AVGfit MINlen\t Maxlen\t AVGlen\t #BB\t AppCov\t AllCov\t AVGins\t MAXins\t AVGms\t MAXms\n")
     stat.flush()
     os.fsync(stat.fileno())
     starttime=time.clock()
@@ -680,11 +1086,17 @@ def main():
         del config.TEMPTRACE[:]
         del config.BBSEENVECTOR[:]
         config.SEENBB.clear()
+        config.SEENEDGE.clear()
+        if config.TOOLFITNESS == True:
+            gau.clearSeenWeights()
+        config.NOVELIN.clear()
         config.TMPBBINFO.clear()
         config.TMPBBINFO.update(config.PREVBBINFO)
         
         fitnes=dict()
+        config.COSTMAP.clear()
         execs=0
+        timeouts=0
         config.cPERGENBB.clear()
         config.GOTSTUCK=False
  
@@ -715,12 +1127,20 @@ def main():
                 #print ''
                 #print 'Input file sha1:', sha1OfFile(tfl)
                 #print 'Going to call:', ' '.join(args)
-                (bbs,retc)=execute(tfl)
-                if config.BBWEIGHT == True:
+                (bbs,retc)=execute(tfl,config.TOOLFITNESS == False)
+                if config.TOOLFITNESS == True and config.LASTFIT is not None:
+                    fitnes[fl]=gau.fitnesTool(fl,iln)
+                elif config.BBWEIGHT == True:
                     fitnes[fl]=gau.fitnesCal2(bbs,fl,iln)
                 else:
                     fitnes[fl]=gau.fitnesNoWeight(bbs,fl,iln)
 
+                if config.LASTNEW:
+                    config.NOVELIN.add(fl)
+                if config.LASTCOST is not None:
+                    config.COSTMAP[fl]=config.LASTCOST
+                if retc == config.TIMEOUTCODE:
+                    timeouts+=1
                 execs+=1
                 #print "** %s: %d"%(fl,fitnes[fl])
                 if retc < 0 and retc != -2:
@@ -728,11 +1148,12 @@ def main():
                     efd.write("%s: %d\n"%(tfl, retc))
                     efd.flush()
                     os.fsync(efd)
-                    tmpHash=sha1OfFile(config.CRASHFILE)
+                    tmpHash=crash_bucket(retc)
                     if tmpHash not in crashHash:
                             crashHash.append(tmpHash)
+                            print "[*] New crash bucket %s"%(tmpHash,)
                             tnow=datetime.now().isoformat().replace(":","-")
-                            nf="%s-%s.%s"%(progname,tnow,gau.splitFilename(fl)[1])
+                            nf="%s-%s-%s.%s"%(progname,tmpHash.replace(":","-"),tnow,gau.splitFilename(fl)[1])
                             npath=os.path.join("outd/crashInputs",nf)
                             shutil.copyfile(tfl,npath)
                             shutil.copy(tfl,config.SPECIAL)
@@ -745,6 +1166,13 @@ def main():
         maxfit=max(fitscore)
         avefit=sum(fitscore)/len(fitscore)
         mnlen,mxlen,avlen=gau.getFileMinMax(config.INPUTD)
+        if timeouts > 0:
+            print "[*] %d of %d inputs hit the instruction budget or timeout."%(timeouts,execs)
+        costins=[c[1] for c in config.COSTMAP.values()] or [0]
+        costms=[c[4] for c in config.COSTMAP.values()] or [0]
+        if len(config.COSTMAP) > 0:
+            slowest=max(config.COSTMAP,key=lambda k: config.COSTMAP[k][1])
+            print "[*] Slowest input %s: %d instructions, %d ms (average %d, %d ms)."%(slowest,config.COSTMAP[slowest][1],config.COSTMAP[slowest][4],sum(costins)/len(costins),sum(costms)/len(costms))
         print "[*] Done with all input in Gen, starting SPECIAL. \n"
         #### copy special inputs in SPECIAL directory and update coverage info ###
         spinputs=os.listdir(config.SPECIAL)
@@ -763,7 +1191,7 @@ def main():
                         shutil.copy(incp,config.SPECIAL)
                         #del fitnes[incp]
         appcov,allcov=gau.calculateCov()
-        stat.write("\t%d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\n"%(genran,min(fitscore),maxfit,avefit,mnlen,mxlen,avlen,len(config.cPERGENBB),appcov,allcov))
+        stat.write("\t%d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\t %d\n"%(genran,min(fitscore),maxfit,avefit,mnlen,mxlen,avlen,len(config.cPERGENBB),appcov,allcov,sum(costins)/len(costins),max(costins),sum(costms)/len(costms),max(costms)))
         stat.flush()
         os.fsync(stat.fileno())
         print "[*] Wrote to stat.log\n"
@@ -818,8 +1246,10 @@ def main():
 
     efd.close()
     stat.close()
-    libfd_mm.close()
-    libfd.close()
+    stop_forkserver()
+    stop_taintserver()
+    if EDGEMM is not None:
+        EDGEMM.close()
     endtime=time.clock()
     
     print "[**] Totol time %f sec."%(endtime-starttime,)
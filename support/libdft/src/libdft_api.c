@@ -42,9 +42,11 @@
 #include <fstream>
 #include <string.h>
 #include <unistd.h>
+#include <set>
 
 #include "libdft_api.h"
 #include "libdft_core.h"
+#include "libdft_replay.h"
 #include "syscall_desc.h"
 #include "tagmap.h"
 #include "branch_pred.h"
@@ -64,6 +66,10 @@ extern syscall_desc_t syscall_desc[SYSCALL_MAX];
 /* ins descriptors */
 ins_desc_t ins_desc[XED_ICLASS_LAST];
 
+/* contexts of the live threads; see libdft_tainted() */
+static PIN_LOCK thread_ctx_lock;
+static std::set<thread_ctx_t *> thread_ctxs;
+
 /*
  * thread start callback (analysis function)
  *
@@ -93,6 +99,17 @@ thread_alloc(THREADID tid, CONTEXT *ctx, INT32 flags, VOID *v)
 		libdft_die();
 	}
 
+	/* per-thread cmp/lea logging state */
+	tctx->cmplog = cmp_log_alloc();
+
+	/* handler log, with decoupled propagation */
+	if (replay_on)
+		tctx->rlog = replay_log_alloc(tid, tctx);
+
+	PIN_GetLock(&thread_ctx_lock, 1);
+	thread_ctxs.insert(tctx);
+	PIN_ReleaseLock(&thread_ctx_lock);
+
 	/* save the address of the per-thread context to the spilled register */
 	PIN_SetContextReg(ctx, thread_ctx_ptr, (ADDRINT)tctx);
 }
@@ -114,6 +131,17 @@ thread_free(THREADID tid, const CONTEXT *ctx, INT32 code, VOID *v)
 	thread_ctx_t *tctx = (thread_ctx_t *)
 		PIN_GetContextReg(ctx, thread_ctx_ptr);
 
+	/* replay the rest of its handler log */
+	if (tctx->rlog != NULL)
+		replay_log_free(tctx->rlog);
+
+	/* merge the pending records of the thread */
+	cmp_log_free(tctx->cmplog);
+
+	PIN_GetLock(&thread_ctx_lock, 1);
+	thread_ctxs.erase(tctx);
+	PIN_ReleaseLock(&thread_ctx_lock);
+
 	/* free the allocated space */
 	free(tctx);
 }
@@ -141,6 +169,10 @@ sysenter_save(THREADID tid, CONTEXT *ctx, SYSCALL_STANDARD std, VOID *v)
 	/* get the syscall number */
 	size_t syscall_nr = PIN_GetSyscallNumber(ctx, std);
 
+	/* the syscall hooks need the tags as of now */
+	if (thread_ctx->rlog != NULL)
+		replay_sync(thread_ctx->rlog);
+
 	/* unknown syscall; optimized branch */
 	if (unlikely(syscall_nr >= SYSCALL_MAX)) {
 		LOG(string(__func__) + ": unknown syscall (num=" +
@@ -409,6 +441,8 @@ thread_ctx_init(void)
 	 * keep track of the threads and allocate/free space for the
 	 * per-thread logistics (i.e., syscall context, VCPU, etc)
 	 */
+	cmp_log_init();
+	PIN_InitLock(&thread_ctx_lock);
 	PIN_AddThreadStartFunction(thread_alloc, NULL);
 	PIN_AddThreadFiniFunction(thread_free, NULL);
 
@@ -458,6 +492,10 @@ fix_eflags(THREADID tid, EXCEPTION_INFO *pExceptInfo,
 std::ofstream out;
 int limit_offset;
 int limit_lea;
+int limit_token;
+volatile long cmp_count = 0;
+long limit_cmp = 0;
+volatile int cmp_log_on = 1;
 
 /*
  * initialization of the core tagging engine;
@@ -529,6 +567,39 @@ libdft_die(void)
 	PIN_Detach();
 }
 
+/*
+ * check whether any tag is still live, in the tagmap or in the
+ * registers of a thread; once none is, and no more tags are set
+ * by the syscall hooks, propagation cannot produce any output
+ *
+ * returns: 1 if a tag is live (always, without custom tags or
+ *          tagmap_track), 0 if not
+ */
+int
+libdft_tainted(void)
+{
+#ifndef USE_CUSTOM_TAG
+	/* the bitmap is updated inline; it is not counted */
+	return 1;
+#else
+	std::set<thread_ctx_t *>::iterator it;
+	size_t i, j;
+	int live = 0;
+
+	if (!tagmap_track || tagmap_live != 0)
+		return 1;
+
+	/* the scratch register only holds tags within a handler pair */
+	PIN_GetLock(&thread_ctx_lock, 1);
+	for (it = thread_ctxs.begin(); it != thread_ctxs.end() && !live; it++)
+		for (i = 0; i < GPR_NUM && !live; i++)
+			for (j = 0; j < TAGS_PER_GPR && !live; j++)
+				live = tag_live((*it)->vcpu.gpr[i][j]);
+	PIN_ReleaseLock(&thread_ctx_lock);
+	return live;
+#endif
+}
+
 /*
  * add a new pre-ins callback into an instruction descriptor
  *
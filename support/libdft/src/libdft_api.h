@@ -145,10 +145,47 @@ typedef struct {
 /* 	ADDRINT errno; */		/* error code */
 } syscall_ctx_t;
 
+#define LOG_FIELDS	13			/* fields of a cmp.out record */
+#define LOG_FIELD_SZ	192			/* bytes per field */
+#define LOG_BUF_SZ	(64 * 1024)		/* per-thread output batch */
+#define TOKEN_MAX	64			/* longest token we keep */
+#define PATCH_LINE_SZ	128			/* one patch.out record */
+
+/* byte-wise compare run under construction (see token.out) */
+typedef struct {
+	ADDRINT		ins_address;	/* last compare of the run */
+	uint32_t	start;		/* input offset of the first byte */
+	uint32_t	len;		/* bytes in the run */
+	uint8_t		bytes[TOKEN_MAX];	/* expected bytes */
+} cmp_token_t;
+
+/*
+ * per-thread state of the cmp/lea/token loggers;
+ * records are built in fixed-size fields and batched in
+ * per-thread buffers, which are merged into the shared
+ * output files when full, on thread exit, and at exit
+ */
+typedef struct cmp_log {
+	char		field[LOG_FIELDS][LOG_FIELD_SZ];	/* record */
+	int		noff[LOG_FIELDS];	/* offsets per field; -1 if cut */
+	std::string	cmp_buf;		/* pending cmp.out records */
+	std::string	lea_buf;		/* pending lea.out records */
+	std::string	token_buf;		/* pending token.out records */
+	std::string	patch_buf;		/* pending patch.out records */
+	ADDRINT		patch_ins;		/* last patched cmp (dedup) */
+	uint32_t	patch_off;
+	ADDRINT		patch_val;
+	cmp_token_t	token;			/* current byte-compare run */
+	struct cmp_log	*next;			/* all logs (merged at exit) */
+} cmp_log_t;
+
 /* thread context definition */
 typedef struct {
 	vcpu_ctx_t	vcpu;		/* VCPU context */
 	syscall_ctx_t	syscall_ctx;	/* syscall context */
+	cmp_log_t	*cmplog;	/* cmp/lea logging state */
+	struct replay_log *rlog;	/* handler log (libdft_replay.h) */
+	ADDRINT		rval[2];	/* memory reads of a replayed handler */
 	void		*uval;		/* local storage */
 } thread_ctx_t;
 
@@ -170,9 +207,21 @@ extern std::ofstream out;
 
 extern int limit_offset;
 extern int limit_lea;
+extern int limit_token;
+
+/* cmp.out records written, and the most to write (0: no limit) */
+extern volatile long cmp_count;
+extern long limit_cmp;
+
+/* the cmp/lea/token/patch records are dropped while zero */
+extern volatile int cmp_log_on;
+
+/* merge the per-thread cmp/lea/token records into the output files */
+void	cmp_log_flush(void);
 
 int	libdft_init(ADDRINT version_mask = 0);
 void	libdft_die(void);
+int	libdft_tainted(void);
 
 /* ins API */
 int	ins_set_pre(ins_desc_t*, void (*)(INS));
@@ -52,12 +52,47 @@
 #include "pin.H"
 #include "libdft_api.h"
 #include "libdft_core.h"
+#include "libdft_replay.h"
 #include "tagmap.h"
 #include "branch_pred.h"
 
+/*
+ * with decoupled propagation, the handler calls of ins_inspect()
+ * are logged instead of inserted (libdft_replay.h); the names in
+ * parentheses are the Pin functions
+ */
+#define INS_InsertCall(ins, ...)					\
+	(replay_on ? replay_insert(REPLAY_CALL, ins, __VA_ARGS__) :	\
+		(INS_InsertCall)(ins, __VA_ARGS__))
+#define INS_InsertPredicatedCall(ins, ...)				\
+	(replay_on ? replay_insert(REPLAY_PREDICATED, ins, __VA_ARGS__) :\
+		(INS_InsertPredicatedCall)(ins, __VA_ARGS__))
+#define INS_InsertIfCall(ins, ...)					\
+	(replay_on ? replay_insert(REPLAY_IF, ins, __VA_ARGS__) :	\
+		(INS_InsertIfCall)(ins, __VA_ARGS__))
+#define INS_InsertIfPredicatedCall(ins, ...)				\
+	(replay_on ? replay_insert(REPLAY_IF_PREDICATED, ins, __VA_ARGS__) :\
+		(INS_InsertIfPredicatedCall)(ins, __VA_ARGS__))
+#define INS_InsertThenCall(ins, ...)					\
+	(replay_on ? replay_insert(REPLAY_THEN, ins, __VA_ARGS__) :	\
+		(INS_InsertThenCall)(ins, __VA_ARGS__))
+#define INS_InsertThenPredicatedCall(ins, ...)				\
+	(replay_on ? replay_insert(REPLAY_THEN_PREDICATED, ins, __VA_ARGS__) :\
+		(INS_InsertThenPredicatedCall)(ins, __VA_ARGS__))
+
+/*
+ * value of a memory operand that a handler reads; replayed handlers
+ * run after the memory may have changed, and get the value that was
+ * logged when the instruction ran instead (i is the position of the
+ * operand among the memory reads of the handler; see ins_reads_mem())
+ */
+#define MEM_VAL(ctx, i, type, addr)					\
+	(replay_on ? (type)(ctx)->rval[i] : *(type *)(addr))
+
 
 extern int limit_offset;
 extern int limit_lea;
+extern int limit_token;
 /* thread context */
 extern REG	thread_ctx_ptr;
 
@@ -71,6 +106,8 @@ extern tag_dir_t tag_dir;
 
 extern std::ofstream out;
 extern std::ofstream lea_offset;
+extern std::ofstream token_offset;
+extern std::ofstream patch_offset;
 
 #ifndef USE_CUSTOM_TAG
 /* fast tag extension (helper); [0] -> 0, [1] -> VCPU_MASK16 */
@@ -713,57 +750,367 @@ _cmpxchg_r2r_opl_fast(thread_ctx_t *thread_ctx, uint32_t dst_val, uint32_t src,
 }
 
 
-vector<std::string> splitted;
-void split( std::string const& original, char separator )
-{
-    std::string::const_iterator start = original.begin();
-    std::string::const_iterator end = original.end();
-    std::string::const_iterator next = std::find( start, end, separator );
-    while ( next != end ) {
-        splitted.push_back( std::string( start, next ) );
-        start = next + 1;
-        next = std::find( start, end, separator );
-    }
-    splitted.push_back( std::string( start, next ) );
+/*
+ * cmp/lea logging
+ *
+ * every thread builds its records in the fixed-size fields of its own
+ * cmp_log_t (thread_ctx->cmplog) and appends them to per-thread
+ * buffers; the analysis path takes no lock and builds no std::string.
+ * Full buffers are merged into the shared output files under
+ * cmp_log_lock, as are the leftovers on thread exit and at exit
+ */
+static PIN_LOCK cmp_log_lock;
+static cmp_log_t *cmp_logs = NULL;
+
+void cmp_log_init(void){
+   PIN_InitLock(&cmp_log_lock);
 }
 
-vector<string> output(13,"{}");
-void print_log(){
-   splitted.clear();
-   for(size_t i=3;i<11;i++){
-	split(output[i],',');
-	if((int)splitted.size() > limit_offset){
-		splitted.clear();
-		return;
+cmp_log_t *cmp_log_alloc(void){
+   cmp_log_t *cmplog = new cmp_log_t();
+
+   cmplog->cmp_buf.reserve(LOG_BUF_SZ + LOG_FIELDS * LOG_FIELD_SZ);
+   cmplog->lea_buf.reserve(LOG_BUF_SZ + LOG_FIELDS * LOG_FIELD_SZ);
+   cmplog->token_buf.reserve(LOG_BUF_SZ + 4 * TOKEN_MAX);
+   cmplog->patch_buf.reserve(LOG_BUF_SZ + PATCH_LINE_SZ);
+
+   PIN_GetLock(&cmp_log_lock, 1);
+   cmplog->next = cmp_logs;
+   cmp_logs = cmplog;
+   PIN_ReleaseLock(&cmp_log_lock);
+   return cmplog;
+}
+
+/* append the buffered records to the output files; cmp_log_lock held */
+static void cmp_log_merge(cmp_log_t *cmplog){
+   if(!cmplog->cmp_buf.empty()){
+	out.write(cmplog->cmp_buf.data(), cmplog->cmp_buf.size());
+	cmplog->cmp_buf.clear();
+   }
+   if(!cmplog->lea_buf.empty()){
+	lea_offset.write(cmplog->lea_buf.data(), cmplog->lea_buf.size());
+	cmplog->lea_buf.clear();
+   }
+   if(!cmplog->token_buf.empty()){
+	token_offset.write(cmplog->token_buf.data(), cmplog->token_buf.size());
+	cmplog->token_buf.clear();
+   }
+   if(!cmplog->patch_buf.empty()){
+	patch_offset.write(cmplog->patch_buf.data(), cmplog->patch_buf.size());
+	cmplog->patch_buf.clear();
+   }
+}
+
+static void cmp_log_drain(cmp_log_t *cmplog){
+   PIN_GetLock(&cmp_log_lock, 1);
+   cmp_log_merge(cmplog);
+   PIN_ReleaseLock(&cmp_log_lock);
+}
+
+static void cmp_token_flush(cmp_log_t *cmplog);
+
+void cmp_log_free(cmp_log_t *cmplog){
+   cmp_log_t **p;
+
+   if(cmplog == NULL)
+	return;
+   cmp_token_flush(cmplog);
+   PIN_GetLock(&cmp_log_lock, 1);
+   cmp_log_merge(cmplog);
+   for(p = &cmp_logs; *p != NULL; p = &(*p)->next){
+	if(*p == cmplog){
+		*p = cmplog->next;
+		break;
 	}
-	splitted.clear();
    }
-   for(size_t i=0;i<13;i++){
-     out << output[i];
-     out << " ";
+   PIN_ReleaseLock(&cmp_log_lock);
+   delete cmplog;
+}
+
+void cmp_log_flush(void){
+   cmp_log_t *cmplog;
+
+   PIN_GetLock(&cmp_log_lock, 1);
+   for(cmplog = cmp_logs; cmplog != NULL; cmplog = cmplog->next){
+	cmp_token_flush(cmplog);
+	cmp_log_merge(cmplog);
+   }
+   PIN_ReleaseLock(&cmp_log_lock);
+}
+
+static inline void log_set(cmp_log_t *cmplog, size_t i, const char *s){
+   char *f = cmplog->field[i];
+
+   while((*f++ = *s++) != '\0')
+	;
+   cmplog->noff[i] = 0;
+}
+
+/* start a new record; all fields empty */
+static inline void log_clear(cmp_log_t *cmplog){
+   for(size_t i=0;i<LOG_FIELDS;i++)
+	log_set(cmplog, i, "{}");
+}
+
+/* hex value as "0x..."; padded to digits (if non-zero) */
+static inline void log_hex(cmp_log_t *cmplog, size_t i, ADDRINT val,
+		size_t digits = 0){
+   static const char hex[] = "0123456789abcdef";
+   char *f = cmplog->field[i];
+   size_t len = 1;
+
+   while(len < 2 * sizeof(ADDRINT) && (val >> (4 * len)))
+	len++;
+   if(len < digits)
+	len = digits;
+   f[0] = '0';
+   f[1] = 'x';
+   f[len + 2] = '\0';
+   for(; len > 0; len--, val >>= 4)
+	f[len + 1] = hex[val & 0xf];
+   cmplog->noff[i] = 0;
+}
+
+static inline void log_addr(cmp_log_t *cmplog, size_t i, ADDRINT ins_address){
+   log_hex(cmplog, i, ins_address, 2 * sizeof(ADDRINT));
+}
+
+static inline void log_tag(cmp_log_t *cmplog, size_t i, tag_t const & tag){
+   cmplog->noff[i] = tag_snprint(tag, cmplog->field[i], LOG_FIELD_SZ);
+}
+
+static inline void log_append(std::string & buf, const char *s){
+   buf.append(s);
+   buf.push_back(' ');
+}
+
+/* a field cut short had more offsets than any sane limit */
+static inline bool log_over(cmp_log_t *cmplog, size_t from, size_t to, int limit){
+   for(size_t i=from;i<to;i++){
+	if(cmplog->noff[i] < 0 || cmplog->noff[i] > limit)
+		return true;
+   }
+   return false;
+}
+
+void print_log(cmp_log_t *cmplog){
+   if(!cmp_log_on || log_over(cmplog, 3, 11, limit_offset))
+	return;
+   /* record budget (-maxcmp) */
+   if(limit_cmp > 0 && cmp_count >= limit_cmp)
+	return;
+   __sync_fetch_and_add(&cmp_count, 1);
+   for(size_t i=0;i<LOG_FIELDS;i++)
+     log_append(cmplog->cmp_buf, cmplog->field[i]);
+   cmplog->cmp_buf.push_back('\n');
+   if(cmplog->cmp_buf.size() >= LOG_BUF_SZ)
+	cmp_log_drain(cmplog);
+}
+
+void print_lea_log(cmp_log_t *cmplog){
+   if(!cmp_log_on || log_over(cmplog, 7, 11, limit_lea))
+	return;
+   log_append(cmplog->lea_buf, cmplog->field[0]);
+   log_append(cmplog->lea_buf, cmplog->field[2]);
+   for(size_t i=7;i<11;i++)
+     log_append(cmplog->lea_buf, cmplog->field[i]);
+   cmplog->lea_buf.push_back('\n');
+   if(cmplog->lea_buf.size() >= LOG_BUF_SZ)
+	cmp_log_drain(cmplog);
+}
+
+/*
+ * byte-wise compare coalescing
+ *
+ * magic values are often checked one byte at a time (repe cmpsb, or a
+ * loop around a byte cmp). A run of byte compares issued from the same or
+ * nearby instructions, over consecutive input offsets, against constant
+ * bytes is collapsed into one record in token.out:
+ *
+ * ins-address start-offset length bytes
+ *
+ * where bytes are the expected input bytes in file order (hex). Runs in
+ * which every expected byte is the same come from scanning loops (strchr,
+ * memchr, ...) and are dropped.
+ */
+#define TOKEN_INS_WINDOW	32	/* max distance between cmps of a run */
+
+static void cmp_token_flush(cmp_log_t *cmplog){
+   static const char hex[] = "0123456789abcdef";
+   cmp_token_t *token = &cmplog->token;
+   char buf[2*TOKEN_MAX + 1];
+   char line[2*TOKEN_MAX + 64];
+   uint32_t i;
+
+   if(token->len < (uint32_t)limit_token || token->len < 2){
+	token->len = 0;
+	return;
+   }
+   for(i=1;i<token->len;i++){
+	if(token->bytes[i] != token->bytes[0])
+		break;
+   }
+   if(i == token->len){
+	token->len = 0;
+	return;
+   }
+   for(i=0;i<token->len;i++){
+	buf[2*i] = hex[token->bytes[i] >> 4];
+	buf[2*i+1] = hex[token->bytes[i] & 0xf];
    }
-   out << "\n";
+   buf[2*token->len] = '\0';
+   snprintf(line, sizeof(line), "0x%0*lx %u %u %s\n",
+	(int)(2 * sizeof(ADDRINT)), (unsigned long)token->ins_address,
+	token->start, token->len, buf);
+   cmplog->token_buf.append(line);
+   token->len = 0;
 }
 
-void print_lea_log(){
-   splitted.clear();
-   for(size_t i=7;i<11;i++){
-	split(output[i],',');
-	if((int)splitted.size() > limit_lea){
-		splitted.clear();
+/*
+ * feed a byte compare to the coalescer; exactly one operand must carry a
+ * single input offset and the other must be untainted (i.e., constant)
+ */
+static inline void
+cmp_token_feed(cmp_log_t *cmplog, ADDRINT ins_address, tag_t const & a_tag,
+		uint8_t a_val, tag_t const & b_tag, uint8_t b_val)
+{
+   cmp_token_t *token = &cmplog->token;
+   uint32_t off;
+   uint8_t expected;
+
+   if(!cmp_log_on || !token_offset.is_open())
+	return;
+
+   if(tag_single(a_tag, off) && !tag_count(b_tag))
+	expected = b_val;
+   else if(tag_single(b_tag, off) && !tag_count(a_tag))
+	expected = a_val;
+   else
+	return;
+
+   /* extend the current run */
+   if(token->len > 0 && token->len < TOKEN_MAX &&
+	off == token->start + token->len &&
+	ins_address + TOKEN_INS_WINDOW >= token->ins_address &&
+	ins_address <= token->ins_address + TOKEN_INS_WINDOW){
+	token->bytes[token->len++] = expected;
+	token->ins_address = ins_address;
+	return;
+   }
+
+   /* the same byte compared again (e.g., retried); keep the latest value */
+   if(token->len > 0 && off == token->start + token->len - 1 &&
+	ins_address == token->ins_address){
+	token->bytes[token->len - 1] = expected;
+	return;
+   }
+
+   cmp_token_flush(cmplog);
+   if(cmplog->token_buf.size() >= LOG_BUF_SZ)
+	cmp_log_drain(cmplog);
+   token->ins_address = ins_address;
+   token->start = off;
+   token->len = 1;
+   token->bytes[0] = expected;
+}
+
+/*
+ * input-to-state patches
+ *
+ * when every tainted byte of one compare operand comes from a single
+ * input offset and the other operand is untainted, writing the other
+ * operand's bytes at those offsets makes the compare hold. Byte i of an
+ * operand is byte i of its (little-endian) value, so the patches are
+ * written in input terms and need no further byte swapping:
+ *
+ * ins-address kind offset:byte[,offset:byte]...
+ *
+ * kind is '=' for the untainted value itself, and '+'/'-' for that value
+ * plus/minus one; the flags consumer (jcc/setcc) is not inspected, so the
+ * off-by-one variants that flip relational compares are always emitted.
+ * Repeats of the last patched compare (same ins, offset and value) are
+ * dropped
+ */
+static inline void
+cmp_patch_emit(cmp_log_t *cmplog, ADDRINT ins_address, size_t width,
+		tag_t const *a_tags, ADDRINT a_val,
+		tag_t const *b_tags, ADDRINT b_val)
+{
+   static const char hex[] = "0123456789abcdef";
+   static const char kinds[] = "=+-";
+   static const int deltas[] = {0, 1, -1};
+   tag_t const *tags;
+   uint32_t off[4];
+   bool tainted[4];
+   ADDRINT val;
+   char line[PATCH_LINE_SZ];
+   size_t i, j, k = 0, n;
+   int len;
+
+   if(!cmp_log_on || !patch_offset.is_open())
+	return;
+
+   /* the operand holding the input bytes; the other must be constant */
+   tags = a_tags;
+   val = b_val;
+   if(b_tags != NULL){
+	for(i=0;i<width;i++){
+		if(tag_count(b_tags[i]))
+			break;
+	}
+	if(i < width){
+		for(j=0;j<width;j++){
+			if(tag_count(a_tags[j]))
+				return;
+		}
+		tags = b_tags;
+		val = a_val;
+	}
+   }
+
+   for(i=0, n=0;i<width;i++){
+	tainted[i] = tag_count(tags[i]) != 0;
+	if(!tainted[i])
+		continue;
+	if(!tag_single(tags[i], off[i]))
 		return;
+	/* the same offset twice in one operand cannot be patched */
+	for(j=0;j<i;j++){
+		if(tainted[j] && off[j] == off[i])
+			return;
 	}
-	splitted.clear();
+	if(n++ == 0)
+		k = i;
    }
-   lea_offset << output[0];
-   lea_offset <<" ";
-   lea_offset << output[2];
-   lea_offset <<" ";
-   for(size_t i=7;i<11;i++){
-     lea_offset << output[i];
-     lea_offset << " ";
+   if(n == 0)
+	return;
+
+   if(ins_address == cmplog->patch_ins && off[k] == cmplog->patch_off &&
+	val == cmplog->patch_val)
+	return;
+   cmplog->patch_ins = ins_address;
+   cmplog->patch_off = off[k];
+   cmplog->patch_val = val;
+
+   for(k=0;k<sizeof(deltas)/sizeof(deltas[0]);k++){
+	ADDRINT v = val + deltas[k];
+
+	len = snprintf(line, sizeof(line), "0x%0*lx %c ",
+		(int)(2 * sizeof(ADDRINT)), (unsigned long)ins_address,
+		kinds[k]);
+	for(i=0, j=0;i<width;i++){
+		uint8_t byte = (v >> (8 * i)) & 0xff;
+
+		if(!tainted[i])
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, "%s%u:%c%c",
+			j++ ? "," : "", off[i], hex[byte >> 4], hex[byte & 0xf]);
+	}
+	line[len++] = '\n';
+	cmplog->patch_buf.append(line, len);
    }
-   lea_offset << "\n";
+   if(cmplog->patch_buf.size() >= LOG_BUF_SZ)
+	cmp_log_drain(cmplog);
 }
 
 /*
@@ -795,37 +1142,35 @@ r2r_cmp_opl(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint32_
 	/* update */
     tag_t dst_tags[] = R32TAG(dst);
     tag_t src_tags[] = R32TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(dst_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(dst_tags[i]);
+        log_tag(cmplog, i+3, dst_tags[i]);
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
     //LOG(StringFromAddrint(ins_address) +" "+ to_string(dst)+" " + tag_sprint(dst_tags[0]) + " " + to_string(src) + " " + tag_sprint(src_tags[0]) + " " + to_string(fl) + "\n");
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 4, dst_tags, dst_val, src_tags, src_val);
 	//out << "\n";
     }
-   // output.clear();
 #endif
 }
 
@@ -942,35 +1287,34 @@ r2r_cmp_opw(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint16_
     tag_t save_tags[] = R16TAG(dst);
     tag_t src_tags[] = R16TAG(src);
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(save_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(save_tags[i]);
+        log_tag(cmplog, i+3, save_tags[i]);
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 2, save_tags, dst_val, src_tags, src_val);
 	//out << "\n";
     }
-    //output.clear();
 #endif
 
 	/* compare the dst and src values */
@@ -1059,7 +1403,7 @@ _cmpxchg_m2r_opl_fast(thread_ctx_t *thread_ctx, uint32_t dst_val, ADDRINT src)
 #endif
 	
 	/* compare the dst and src values; the original values the tag bits */
-	return (dst_val == *(uint32_t *)src);
+	return (dst_val == MEM_VAL(thread_ctx, 0, uint32_t, src));
 }
 
 /*
@@ -1148,7 +1492,7 @@ _cmpxchg_m2r_opw_fast(thread_ctx_t *thread_ctx, uint16_t dst_val, ADDRINT src)
 #endif
 	
 	/* compare the dst and src values; the original values the tag bits */
-	return (dst_val == *(uint16_t *)src);
+	return (dst_val == MEM_VAL(thread_ctx, 0, uint16_t, src));
 }
 
 /*
@@ -1265,32 +1609,32 @@ r2r_cmp_opb_ul(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][1];
     tag_t src_tag = thread_ctx->vcpu.gpr[src][0];
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
+    log_tag(cmplog, 3, tmp_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, &src_tag, src_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, src_tag, src_val);
     }
-    //output.clear();
 	/* swap */
 //    thread_ctx->vcpu.gpr[dst][1] = src_tag;
 //    thread_ctx->vcpu.gpr[src][0] = tmp_tag;
@@ -1367,32 +1711,32 @@ r2r_cmp_opb_lu(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][0];
     tag_t src_tag = thread_ctx->vcpu.gpr[src][1];
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
+    log_tag(cmplog, 3, tmp_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, &src_tag, src_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, src_tag, src_val);
     }
-    //output.clear();
 #endif
 }
 /*
@@ -1465,32 +1809,32 @@ r2r_cmp_opb_u(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint8
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][1];
     tag_t src_tag = thread_ctx->vcpu.gpr[src][1];
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
+    log_tag(cmplog, 3, tmp_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, &src_tag, src_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, src_tag, src_val);
     }
-    //output.clear();
    // thread_ctx->vcpu.gpr[dst][1] = src_tag;
    // thread_ctx->vcpu.gpr[src][1] = tmp_tag;
 #endif
@@ -1565,32 +1909,32 @@ r2r_cmp_opb_l(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint8
 	/* temporary tag value */
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][0];
     tag_t src_tag = thread_ctx->vcpu.gpr[src][0];
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg reg";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg reg");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
+    log_tag(cmplog, 3, tmp_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(src_val);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, src_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, &src_tag, src_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, src_tag, src_val);
     }
-    //output.clear();
 	/* swap */
 //    thread_ctx->vcpu.gpr[dst][0] = src_tag;
 //    thread_ctx->vcpu.gpr[src][0] = tmp_tag;
@@ -2187,33 +2531,32 @@ _lea_r2r_opw(ADDRINT ins_address, thread_ctx_t *thread_ctx,
 #else
     tag_t base_tag[] = R16TAG(base);
     tag_t idx_tag[] = R16TAG(index);
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "baseidx";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "baseidx");
     int fl = 0;
 /*    for (size_t i = 0; i < 2; i++){
 	if(tag_count(base_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(base_tag[i]);
+        log_tag(cmplog, i+3, base_tag[i]);
     }*/
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(idx_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(idx_tag[i]);
+        log_tag(cmplog, i+7, idx_tag[i]);
     }
 
     if(fl == 1){
-        print_lea_log();
+        print_lea_log(cmplog);
     }
 
 
@@ -2251,34 +2594,33 @@ _lea_r2r_opl(ADDRINT ins_address, thread_ctx_t *thread_ctx,
 //	RTAG[base][0].set(1);
     tag_t base_tag[] = R32TAG(base);
     tag_t idx_tag[] = R32TAG(index);
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    } 
-    output[0] = "32";
-    output[1] = "baseidx";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "baseidx");
     int fl = 0;
 /*   for (size_t i = 0; i < 4; i++){
 //	if(tag_count(base_tag[i])){
 //		if(fl == 0){
-//	      		output[2] = StringFromAddrint(ins_address);
+//	      		log_addr(cmplog, 2, ins_address);
 //			fl = 1;
 //		}
 //	}
-//        output[i+3] = tag_sprint(base_tag[i]);
+//        log_tag(cmplog, i+3, base_tag[i]);
 //    }*/
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(idx_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(idx_tag[i]);
+        log_tag(cmplog, i+7, idx_tag[i]);
     }
-    //output[11] = hexstr(dst_val);
-    //output[12] = hexstr(imm_val);
+    //log_hex(cmplog, 11, dst_val);
+    //log_hex(cmplog, 12, imm_val);
     if(fl == 1){
-        print_lea_log();
+        print_lea_log(cmplog);
     }
 
     RTAG[dst][0] = tag_combine(base_tag[0], idx_tag[0]);
@@ -3149,23 +3491,22 @@ r2r_lea_idx_xfer_opw(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst
 #else
      tag_t src_tag[] = R16TAG(src);
    
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "onlyidx";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "onlyidx");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(src_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tag[i]);
+        log_tag(cmplog, i+7, src_tag[i]);
     }
     if(fl == 1){
-        print_lea_log();
+        print_lea_log(cmplog);
     }
  
 
@@ -3184,23 +3525,22 @@ r2r_lea_base_xfer_opw(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t ds
 #else
      tag_t src_tag[] = R16TAG(src);
    
-/*    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "onlybase";
+/*    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "onlybase");
     int fl = 0;
 //     for (size_t i = 0; i < 2; i++){
 //	if(tag_count(src_tag[i])){
 //		if(fl == 0){
-//	      		output[2] = StringFromAddrint(ins_address);
+//	      		log_addr(cmplog, 2, ins_address);
 //			fl = 1;
 //		}
 //	}
-//        output[i+3] = tag_sprint(src_tag[i]);
+//        log_tag(cmplog, i+3, src_tag[i]);
 //    }
 //    if(fl == 1){
-//        print_lea_log();
+//        print_lea_log(cmplog);
 //    }*/
  
 
@@ -3244,23 +3584,22 @@ r2r_lea_idx_xfer_opl(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst
 #else
      tag_t src_tag[] = R32TAG(src);
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "onlyidx";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "onlyidx");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(src_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tag[i]);
+        log_tag(cmplog, i+7, src_tag[i]);
     }
     if(fl == 1){
-        print_lea_log();
+        print_lea_log(cmplog);
     }
  
      RTAG[dst][0] = src_tag[0];
@@ -3279,23 +3618,22 @@ r2r_lea_base_xfer_opl(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t ds
 #else
      tag_t src_tag[] = R32TAG(src);
 
-/*    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "onlybase";
+/*    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "onlybase");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(src_tag[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(src_tag[i]);
+        log_tag(cmplog, i+3, src_tag[i]);
     }
     if(fl == 1){
-        print_lea_log();
+        print_lea_log(cmplog);
     }*/
  
      RTAG[dst][0] = src_tag[0];
@@ -4173,27 +4511,26 @@ r2i_cmp_l(ADDRINT ins_address, thread_ctx_t *thread_ctx,  uint32_t dst, uint32_t
 #ifndef USE_CUSTOM_TAG
 	// TODO:
 #else
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "reg imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "reg imm");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(thread_ctx->vcpu.gpr[dst][i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(thread_ctx->vcpu.gpr[dst][i]);
+        log_tag(cmplog, i+3, thread_ctx->vcpu.gpr[dst][i]);
     }
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(imm_val);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 4, thread_ctx->vcpu.gpr[dst], dst_val, NULL, imm_val);
     }
-    //output.clear();
 #endif
 }
 
@@ -4204,25 +4541,25 @@ r2i_cmp_w(ADDRINT ins_address, thread_ctx_t *thread_ctx,  uint32_t dst, uint16_t
 #ifndef USE_CUSTOM_TAG
 	// TODO:
 #else
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "reg imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "reg imm");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(thread_ctx->vcpu.gpr[dst][i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(thread_ctx->vcpu.gpr[dst][i]);
+        log_tag(cmplog, i+3, thread_ctx->vcpu.gpr[dst][i]);
     }
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr((uint16_t)imm_val);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, (uint16_t)imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 2, thread_ctx->vcpu.gpr[dst], dst_val, NULL, imm_val);
     }
 #endif
 }
@@ -4237,26 +4574,25 @@ r2i_cmp_bl(ADDRINT ins_address, thread_ctx_t *thread_ctx,  uint32_t dst, uint8_t
 	// TODO:
 #else
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][0];
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg imm");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr((uint8_t)imm_val);
+    log_tag(cmplog, 3, tmp_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, (uint8_t)imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, NULL, imm_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, tag_traits<tag_t>::cleared_val, (uint8_t)imm_val);
     }
-    //output.clear();
 #endif
 }
 
@@ -4267,26 +4603,25 @@ r2i_cmp_bu(ADDRINT ins_address, thread_ctx_t *thread_ctx,  uint32_t dst, uint8_t
 	// TODO:
 #else
     tag_t tmp_tag = thread_ctx->vcpu.gpr[dst][1];
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg imm");
     int fl = 0;
     if(tag_count(tmp_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(tmp_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(imm_val);
+    log_tag(cmplog, 3, tmp_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &tmp_tag, dst_val, NULL, imm_val);
+        cmp_token_feed(cmplog, ins_address, tmp_tag, dst_val, tag_traits<tag_t>::cleared_val, (uint8_t)imm_val);
     }
-    //output.clear();
 #endif
 }
 
@@ -4301,35 +4636,33 @@ r2m_cmp_l(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint32_t
     tag_t tmp_tags[] = R32TAG(dst);
     tag_t src_tags[] = M32TAG(src);
 
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "reg mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "reg mem");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(tmp_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(tmp_tags[i]);
+        log_tag(cmplog, i+3, tmp_tags[i]);
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(*(uint32_t *)src);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 0, uint32_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 4, tmp_tags, dst_val, src_tags, MEM_VAL(thread_ctx, 0, uint32_t, src));
     }
-    //output.clear();
 #endif
 }
 
@@ -4343,36 +4676,34 @@ r2m_cmp_w(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint16_t
     tag_t tmp_tags[] = R16TAG(dst);
     tag_t src_tags[] = M16TAG(src);
 
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "reg mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "reg mem");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(tmp_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(tmp_tags[i]);
+        log_tag(cmplog, i+3, tmp_tags[i]);
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(*(uint16_t *)src);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 0, uint16_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 2, tmp_tags, dst_val, src_tags, MEM_VAL(thread_ctx, 0, uint16_t, src));
 	//out << "\n";
     }
-    //output.clear();
 #endif
 }
 
@@ -4385,34 +4716,33 @@ r2m_cmp_bl(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint8_t
 	/* temporary tag value */
     tag_t dst_tag = thread_ctx->vcpu.gpr[dst][0];
     tag_t src_tag = M8TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg mem");
     int fl = 0;
 //    LOG("r2m_cmp_bl " + tag_sprint(src_tag) + " " + StringFromAddrint(src) + "\n");
     if(tag_count(dst_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(dst_tag);
+    log_tag(cmplog, 3, dst_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(*(uint8_t *)src);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 0, uint8_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &dst_tag, dst_val, &src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src));
+        cmp_token_feed(cmplog, ins_address, dst_tag, dst_val, src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src));
     }
-    //output.clear();
 #endif
 }
 
@@ -4426,132 +4756,126 @@ r2m_cmp_bu(ADDRINT ins_address, thread_ctx_t *thread_ctx, uint32_t dst, uint8_t
     tag_t dst_tag = thread_ctx->vcpu.gpr[dst][1];
     tag_t src_tag = M8TAG(src);
 
-    //vector<string> output(5,"");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "reg mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "reg mem");
     int fl = 0;
     if(tag_count(dst_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(dst_tag);
+    log_tag(cmplog, 3, dst_tag);
     if(tag_count(src_tag)){
 	if(fl == 0){
-      		output[2] = StringFromAddrint(ins_address);
+      		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[4] = tag_sprint(src_tag);
-    output[11] = hexstr(dst_val);
-    output[12] = hexstr(*(uint8_t *)src);
+    log_tag(cmplog, 4, src_tag);
+    log_hex(cmplog, 11, dst_val);
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 0, uint8_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &dst_tag, dst_val, &src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src));
+        cmp_token_feed(cmplog, ins_address, dst_tag, dst_val, src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src));
     }
-    //output.clear();
 #endif
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-m2i_cmp_l(ADDRINT ins_address, ADDRINT src, ADDRINT imm_val)
+m2i_cmp_l(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT src, ADDRINT imm_val)
 {
 #ifndef USE_CUSTOM_TAG
 	// TODO:
 #else
     tag_t src_tags[] = M32TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "mem imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "mem imm");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+3, src_tags[i]);
     }
-    output[11] = hexstr(*(uint32_t *)src);
-    output[12] = hexstr(imm_val);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint32_t, src));
+    log_hex(cmplog, 12, imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 4, src_tags, MEM_VAL(thread_ctx, 0, uint32_t, src), NULL, imm_val);
     }
-    //output.clear();
 #endif
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-m2i_cmp_w(ADDRINT ins_address, ADDRINT src, ADDRINT imm_val)
+m2i_cmp_w(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT src, ADDRINT imm_val)
 {
 #ifndef USE_CUSTOM_TAG
 	// TODO:
 #else
     tag_t src_tags[] = M16TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "mem imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "mem imm");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
 	if(tag_count(src_tags[i])){
 		if(fl == 0){
-	      		output[2] = StringFromAddrint(ins_address);
+	      		log_addr(cmplog, 2, ins_address);
 			fl = 1;
 		}
 	}
-        output[i+3] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+3, src_tags[i]);
     }
-    output[11] = hexstr(*(uint16_t *)src);
-    output[12] = hexstr((uint16_t)imm_val);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint16_t, src));
+    log_hex(cmplog, 12, (uint16_t)imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 2, src_tags, MEM_VAL(thread_ctx, 0, uint16_t, src), NULL, imm_val);
     }
-    //output.clear();
 #endif
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-m2i_cmp_b(ADDRINT ins_address, ADDRINT src, ADDRINT imm_val)
+m2i_cmp_b(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT src, ADDRINT imm_val)
 {
 #ifndef USE_CUSTOM_TAG
 	// TODO:
 #else
     tag_t src_tag = M8TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "mem imm";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "mem imm");
     int fl = 0;
     if(tag_count(src_tag)){
 	if(fl == 0){
-     		output[2] = StringFromAddrint(ins_address);
+     		log_addr(cmplog, 2, ins_address);
 		fl = 1;
 	}
     }
-    output[3] = tag_sprint(src_tag);
-    output[11] = hexstr(*(uint8_t *)src);
-    output[12] = hexstr((uint8_t)imm_val);
+    log_tag(cmplog, 3, src_tag);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint8_t, src));
+    log_hex(cmplog, 12, (uint8_t)imm_val);
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src), NULL, imm_val);
+        cmp_token_feed(cmplog, ins_address, src_tag, MEM_VAL(thread_ctx, 0, uint8_t, src), tag_traits<tag_t>::cleared_val, (uint8_t)imm_val);
     }
-    //output.clear();
 #endif
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-cmpsd_m2m_xfer_opl(ADDRINT ins_address, ADDRINT dst, ADDRINT src)
+cmpsd_m2m_xfer_opl(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT dst, ADDRINT src)
 {
 
 
@@ -4560,34 +4884,33 @@ cmpsd_m2m_xfer_opl(ADDRINT ins_address, ADDRINT dst, ADDRINT src)
 
     tag_t dst_tags[] = M32TAG(dst);
     tag_t src_tags[] = M32TAG(src);
-    //vector<string> output(13,"{}");
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "32";
-    output[1] = "mem mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "32");
+    log_set(cmplog, 1, "mem mem");
     int fl = 0;
     for (size_t i = 0; i < 4; i++){
         if(tag_count(dst_tags[i])){
                 if(fl == 0){
-                        output[2] = StringFromAddrint(ins_address);
+                        log_addr(cmplog, 2, ins_address);
                         fl = 1;
                 }
         }
-        output[i+3] = tag_sprint(dst_tags[i]);
+        log_tag(cmplog, i+3, dst_tags[i]);
         if(tag_count(src_tags[i])){
                 if(fl == 0){
-                        output[2] = StringFromAddrint(ins_address);
+                        log_addr(cmplog, 2, ins_address);
                         fl = 1;
                 }
         }
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
     //LOG(StringFromAddrint(ins_address) +" "+ to_string(dst)+" " + tag_sprint(dst_tags[0]) + " " + to_string(src) + " " + tag_sprint(src_tags[0]) + " " + to_string(fl) + "\n");
-    output[11] = hexstr(*(uint32_t *)dst);
-    output[12] = hexstr(*(uint32_t *)src);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint32_t, dst));
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 1, uint32_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 4, dst_tags, MEM_VAL(thread_ctx, 0, uint32_t, dst), src_tags, MEM_VAL(thread_ctx, 1, uint32_t, src));
         //out << "\n";
     }
 
@@ -4595,76 +4918,77 @@ cmpsd_m2m_xfer_opl(ADDRINT ins_address, ADDRINT dst, ADDRINT src)
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-cmpsw_m2m_xfer_opw(ADDRINT ins_address, ADDRINT dst, ADDRINT src)
+cmpsw_m2m_xfer_opw(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT dst, ADDRINT src)
 {
 #ifndef USE_CUSTOM_TAG
 #else
     tag_t save_tags[] = M16TAG(dst);
     tag_t src_tags[] = M16TAG(src);
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "16";
-    output[1] = "mem mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "16");
+    log_set(cmplog, 1, "mem mem");
     int fl = 0;
     for (size_t i = 0; i < 2; i++){
         if(tag_count(save_tags[i])){
                 if(fl == 0){
-                        output[2] = StringFromAddrint(ins_address);
+                        log_addr(cmplog, 2, ins_address);
                         fl = 1;
                 }
         }
-        output[i+3] = tag_sprint(save_tags[i]);
+        log_tag(cmplog, i+3, save_tags[i]);
         if(tag_count(src_tags[i])){
                 if(fl == 0){
-                        output[2] = StringFromAddrint(ins_address);
+                        log_addr(cmplog, 2, ins_address);
                         fl = 1;
                 }
         }
-        output[i+7] = tag_sprint(src_tags[i]);
+        log_tag(cmplog, i+7, src_tags[i]);
     }
-    output[11] = hexstr(*(uint16_t *)dst);
-    output[12] = hexstr(*(uint16_t *)src);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint16_t, dst));
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 1, uint16_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 2, save_tags, MEM_VAL(thread_ctx, 0, uint16_t, dst), src_tags, MEM_VAL(thread_ctx, 1, uint16_t, src));
         //out << "\n";
     }
 #endif
 }
 
 static void PIN_FAST_ANALYSIS_CALL
-cmpsb_m2m_xfer_opb(ADDRINT ins_address, ADDRINT dst, ADDRINT src)
+cmpsb_m2m_xfer_opb(ADDRINT ins_address, thread_ctx_t *thread_ctx, ADDRINT dst, ADDRINT src)
 {
 #ifndef USE_CUSTOM_TAG
 #else
     tag_t src_tag = M8TAG(src);
     tag_t dst_tag = M8TAG(dst);
 
-    for(size_t i = 0 ;i<13;i++){
-      output[i] = "{}";
-    }
-    output[0] = "8";
-    output[1] = "mem mem";
+    cmp_log_t *cmplog = thread_ctx->cmplog;
+    log_clear(cmplog);
+    log_set(cmplog, 0, "8");
+    log_set(cmplog, 1, "mem mem");
     int fl = 0;
     if(tag_count(dst_tag)){
         if(fl == 0){
-                output[2] = StringFromAddrint(ins_address);
+                log_addr(cmplog, 2, ins_address);
                 fl = 1;
         }
     }
-    output[3] = tag_sprint(dst_tag);
+    log_tag(cmplog, 3, dst_tag);
     if(tag_count(src_tag)){
         if(fl == 0){
-                output[2] = StringFromAddrint(ins_address);
+                log_addr(cmplog, 2, ins_address);
                 fl = 1;
         }
     }
-    output[7] = tag_sprint(src_tag);
-    output[11] = hexstr(*(uint8_t *)dst);
-    output[12] = hexstr(*(uint8_t *)src);
+    log_tag(cmplog, 7, src_tag);
+    log_hex(cmplog, 11, MEM_VAL(thread_ctx, 0, uint8_t, dst));
+    log_hex(cmplog, 12, MEM_VAL(thread_ctx, 1, uint8_t, src));
     if(fl == 1){
-        print_log();
+        print_log(cmplog);
+        cmp_patch_emit(cmplog, ins_address, 1, &dst_tag, MEM_VAL(thread_ctx, 0, uint8_t, dst), &src_tag, MEM_VAL(thread_ctx, 1, uint8_t, src));
+        cmp_token_feed(cmplog, ins_address, dst_tag, MEM_VAL(thread_ctx, 0, uint8_t, dst), src_tag, MEM_VAL(thread_ctx, 1, uint8_t, src));
     }
 
 #endif
@@ -4680,6 +5004,32 @@ cal(thread_ctx_t* thread_ctx){
     ss1 << RTAG[3][0];
 	LOG("TAG:" + ss1.str() +"\n");
 }*/
+/*
+ * whether a handler reads the value of its memory operands; with
+ * decoupled propagation (libdft_replay.c) these values are logged
+ * along with the effective addresses, and read back with MEM_VAL()
+ *
+ * @fn:		the handler
+ *
+ * returns: 1 if the handler reads application memory, 0 otherwise
+ */
+int
+ins_reads_mem(AFUNPTR fn)
+{
+	return (fn == (AFUNPTR)_cmpxchg_m2r_opl_fast ||
+		fn == (AFUNPTR)_cmpxchg_m2r_opw_fast ||
+		fn == (AFUNPTR)r2m_cmp_l ||
+		fn == (AFUNPTR)r2m_cmp_w ||
+		fn == (AFUNPTR)r2m_cmp_bl ||
+		fn == (AFUNPTR)r2m_cmp_bu ||
+		fn == (AFUNPTR)m2i_cmp_l ||
+		fn == (AFUNPTR)m2i_cmp_w ||
+		fn == (AFUNPTR)m2i_cmp_b ||
+		fn == (AFUNPTR)cmpsd_m2m_xfer_opl ||
+		fn == (AFUNPTR)cmpsw_m2m_xfer_opw ||
+		fn == (AFUNPTR)cmpsb_m2m_xfer_opb);
+}
+
 /*
  * instruction inspection (instrumentation function)
  *
@@ -6392,6 +6742,7 @@ ins_inspect(INS ins)
                                 (AFUNPTR)cmpsd_m2m_xfer_opl,
                                 IARG_FAST_ANALYSIS_CALL,
 				IARG_INST_PTR,
+				IARG_REG_VALUE, thread_ctx_ptr,
 				IARG_MEMORYREAD2_EA,
                                 IARG_MEMORYREAD_EA,
                                 IARG_END);
@@ -6407,6 +6758,7 @@ ins_inspect(INS ins)
                                 (AFUNPTR)cmpsw_m2m_xfer_opw,
                                 IARG_FAST_ANALYSIS_CALL,
 				IARG_INST_PTR,
+				IARG_REG_VALUE, thread_ctx_ptr,
 				IARG_MEMORYREAD2_EA,
                                 IARG_MEMORYREAD_EA,
                                 IARG_END);
@@ -6422,6 +6774,7 @@ ins_inspect(INS ins)
                                 (AFUNPTR)cmpsb_m2m_xfer_opb,
                                 IARG_FAST_ANALYSIS_CALL,
 				IARG_INST_PTR,
+				IARG_REG_VALUE, thread_ctx_ptr,
 				IARG_MEMORYREAD2_EA,
                                 IARG_MEMORYREAD_EA,
                                 IARG_END);
@@ -6749,6 +7102,7 @@ ins_inspect(INS ins)
 							(AFUNPTR)m2i_cmp_l,
 							IARG_FAST_ANALYSIS_CALL,
 							IARG_INST_PTR,
+							IARG_REG_VALUE, thread_ctx_ptr,
 							IARG_MEMORYREAD_EA,
 							IARG_ADDRINT, (ADDRINT)INS_OperandImmediate(ins, OP_1),
 							IARG_END);
@@ -6760,6 +7114,7 @@ ins_inspect(INS ins)
 							(AFUNPTR)m2i_cmp_w,
 							IARG_FAST_ANALYSIS_CALL,
 							IARG_INST_PTR,
+							IARG_REG_VALUE, thread_ctx_ptr,
 							IARG_MEMORYREAD_EA,
 							IARG_ADDRINT, (ADDRINT)INS_OperandImmediate(ins, OP_1),
 							IARG_END);
@@ -6771,6 +7126,7 @@ ins_inspect(INS ins)
 							(AFUNPTR)m2i_cmp_b,
 							IARG_FAST_ANALYSIS_CALL,
 							IARG_INST_PTR,
+							IARG_REG_VALUE, thread_ctx_ptr,
 							IARG_MEMORYREAD_EA,
 							IARG_ADDRINT, (ADDRINT)INS_OperandImmediate(ins, OP_1),
 							IARG_END);
@@ -55,5 +55,10 @@ enum {
 
 /* core API */
 void ins_inspect(INS);
+int ins_reads_mem(AFUNPTR);
+
+void		cmp_log_init(void);
+cmp_log_t	*cmp_log_alloc(void);
+void		cmp_log_free(cmp_log_t *);
 
 #endif /* __LIBDFT_CORE_H__ */
@@ -0,0 +1,957 @@
+#include <stdarg.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+#include "pin.H"
+#include "libdft_api.h"
+#include "libdft_core.h"
+#include "libdft_replay.h"
+#include "branch_pred.h"
+
+#define REPLAY_MAX_ARGS		8		/* handler arguments */
+#define REPLAY_MAX_DYN		6		/* logged operands per call */
+#define REPLAY_MAX_VAL		2		/* logged memory values */
+#define REPLAY_VAL_DYN		4		/* operands, with values */
+#define REPLAY_CHUNK		(64 * 1024)	/* words per log chunk */
+#define REPLAY_SLACK		(REPLAY_MAX_DYN + REPLAY_MAX_VAL + 1)
+						/* longest record */
+#define REPLAY_SITES_BLK	4096		/* call sites per block */
+#define REPLAY_SITES_MAX	4096		/* blocks of call sites */
+#define REPLAY_STACK		(1024 * 1024)	/* worker stack */
+#define REPLAY_FINI_WAIT	1000		/* ms to wait for a worker */
+
+/* thread context pointer; see libdft_api.c */
+extern REG thread_ctx_ptr;
+
+/* handler argument kinds */
+enum {
+/* #define */ ARG_STATIC = 0,		/* known when instrumenting */
+/* #define */ ARG_DYN = 1,		/* logged; val is its record index */
+/* #define */ ARG_CTX = 2		/* the thread context */
+};
+
+/* a handler call, as given to INS_Insert*Call() */
+typedef struct {
+	AFUNPTR		fn;			/* handler */
+	size_t		nargs;			/* arguments */
+	IARG_TYPE	type[REPLAY_MAX_ARGS];	/* IARG of each argument */
+	int		kind[REPLAY_MAX_ARGS];	/* ARG_* */
+	ADDRINT		val[REPLAY_MAX_ARGS];	/* static value or index */
+} replay_call_t;
+
+/*
+ * call site; for an if/then pair whose "if" handler
+ * updates tags, then.fn runs when call.fn returns non-zero
+ */
+typedef struct {
+	replay_call_t	call;
+	replay_call_t	then;
+	size_t		ndyn;			/* logged operands */
+	size_t		nval;			/* logged memory values */
+} replay_site_t;
+
+/*
+ * the operands logged at a call site, in IARG form; the memory
+ * that the operands in vmask point to is logged after them
+ */
+typedef struct {
+	size_t		n;
+	IARG_TYPE	type[REPLAY_MAX_DYN];
+	REG		reg[REPLAY_MAX_DYN];	/* for IARG_REG_VALUE */
+	size_t		nval;
+	UINT32		vmask;			/* bit i: operand i */
+} replay_dyn_t;
+
+/* full chunk of a log, queued for its worker */
+typedef struct {
+	ADDRINT			*begin;
+	ADDRINT			*end;
+	struct replay_log	*log;
+} replay_chunk_t;
+
+/* replay thread; replays the logs of the threads assigned to it in order */
+typedef struct {
+	PIN_LOCK			lock;	/* protects queue */
+	std::deque<replay_chunk_t>	queue;
+	PIN_SEMAPHORE			work;	/* set when queue is filled */
+	PIN_THREAD_UID			uid;
+} replay_worker_t;
+
+/*
+ * per-thread log; cur/end/buf are only used by the thread itself,
+ * submitted/replayed are the chunks given to and done by the worker
+ */
+typedef struct replay_log {
+	ADDRINT			*cur;		/* next free word */
+	ADDRINT			*end;		/* start of the slack */
+	ADDRINT			*buf;		/* chunk being filled */
+	thread_ctx_t		*tctx;		/* replayed against */
+	replay_worker_t		*worker;
+	volatile UINT64		submitted;
+	volatile UINT64		replayed;
+	PIN_SEMAPHORE		done;		/* set after every chunk */
+	struct replay_log	*next;		/* all logs */
+} replay_log_t;
+
+int replay_on = 0;
+
+/* call sites; only appended to, under the client lock */
+static replay_site_t *sites[REPLAY_SITES_MAX];
+static size_t nsites = 0;
+
+/* "if" handler of ins_inspect() waiting for its "then" */
+enum { IF_NONE, IF_PURE, IF_TAINT };
+static int pending_if = IF_NONE;
+static replay_call_t pending_call;
+static replay_dyn_t pending_dyn;
+
+static replay_worker_t *workers = NULL;
+static size_t nworkers = 0;
+static volatile int replay_stop = 0;
+
+static PIN_LOCK logs_lock;
+static replay_log_t *logs = NULL;
+
+static PIN_LOCK pool_lock;
+static std::vector<ADDRINT *> pool;
+
+/*
+ * log writers (analysis functions); one per number of
+ * logged operands, small enough for Pin to inline them
+ */
+static ADDRINT PIN_FAST_ANALYSIS_CALL
+replay_full(thread_ctx_t *thread_ctx)
+{
+	return thread_ctx->rlog->cur >= thread_ctx->rlog->end;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec0(thread_ctx_t *thread_ctx, ADDRINT site)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	thread_ctx->rlog->cur = p + 1;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec1(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	thread_ctx->rlog->cur = p + 2;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec2(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0, ADDRINT a1)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	p[2] = a1;
+	thread_ctx->rlog->cur = p + 3;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec3(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0, ADDRINT a1,
+		ADDRINT a2)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	p[2] = a1;
+	p[3] = a2;
+	thread_ctx->rlog->cur = p + 4;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec4(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0, ADDRINT a1,
+		ADDRINT a2, ADDRINT a3)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	p[2] = a1;
+	p[3] = a2;
+	p[4] = a3;
+	thread_ctx->rlog->cur = p + 5;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec5(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0, ADDRINT a1,
+		ADDRINT a2, ADDRINT a3, ADDRINT a4)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	p[2] = a1;
+	p[3] = a2;
+	p[4] = a3;
+	p[5] = a4;
+	thread_ctx->rlog->cur = p + 6;
+}
+
+static void PIN_FAST_ANALYSIS_CALL
+replay_rec6(thread_ctx_t *thread_ctx, ADDRINT site, ADDRINT a0, ADDRINT a1,
+		ADDRINT a2, ADDRINT a3, ADDRINT a4, ADDRINT a5)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+
+	p[0] = site;
+	p[1] = a0;
+	p[2] = a1;
+	p[3] = a2;
+	p[4] = a3;
+	p[5] = a4;
+	p[6] = a5;
+	thread_ctx->rlog->cur = p + 7;
+}
+
+static const AFUNPTR replay_recs[REPLAY_MAX_DYN + 1] = {
+	(AFUNPTR)replay_rec0, (AFUNPTR)replay_rec1, (AFUNPTR)replay_rec2,
+	(AFUNPTR)replay_rec3, (AFUNPTR)replay_rec4, (AFUNPTR)replay_rec5,
+	(AFUNPTR)replay_rec6
+};
+
+/*
+ * log writer of the handlers that read application memory
+ * (ins_reads_mem()); the memory may have changed by the time
+ * they are replayed, so the size bytes at the operands in vmask
+ * are logged too, after the n operands
+ */
+static void PIN_FAST_ANALYSIS_CALL
+replay_recv(thread_ctx_t *thread_ctx, ADDRINT site, UINT32 n, UINT32 vmask,
+		UINT32 size, ADDRINT a0, ADDRINT a1, ADDRINT a2, ADDRINT a3)
+{
+	ADDRINT *p = thread_ctx->rlog->cur;
+	ADDRINT a[REPLAY_VAL_DYN] = {a0, a1, a2, a3};
+	UINT32 i;
+
+	*p++ = site;
+	for (i = 0; i < n; i++)
+		*p++ = a[i];
+	for (i = 0; i < n; i++) {
+		if (!(vmask & (1U << i)))
+			continue;
+		switch (size) {
+			case 1:
+				*p++ = *(uint8_t *)a[i];
+				break;
+			case 2:
+				*p++ = *(uint16_t *)a[i];
+				break;
+			default:
+				*p++ = *(uint32_t *)a[i];
+				break;
+		}
+	}
+	thread_ctx->rlog->cur = p;
+}
+
+static ADDRINT *
+chunk_get(void)
+{
+	ADDRINT *chunk;
+
+	PIN_GetLock(&pool_lock, 1);
+	if (pool.empty())
+		chunk = new ADDRINT[REPLAY_CHUNK];
+	else {
+		chunk = pool.back();
+		pool.pop_back();
+	}
+	PIN_ReleaseLock(&pool_lock);
+	return chunk;
+}
+
+static void
+chunk_put(ADDRINT *chunk)
+{
+	PIN_GetLock(&pool_lock, 1);
+	pool.push_back(chunk);
+	PIN_ReleaseLock(&pool_lock);
+}
+
+/*
+ * hand the records of the chunk being filled to the worker
+ * of the log, and start a new chunk; called by the owner thread
+ */
+static void
+replay_submit_log(replay_log_t *log)
+{
+	replay_chunk_t chunk;
+
+	if (log->cur == log->buf)
+		return;
+	chunk.begin = log->buf;
+	chunk.end = log->cur;
+	chunk.log = log;
+	log->submitted++;
+
+	PIN_GetLock(&log->worker->lock, 1);
+	log->worker->queue.push_back(chunk);
+	PIN_ReleaseLock(&log->worker->lock);
+	PIN_SemaphoreSet(&log->worker->work);
+
+	log->buf = log->cur = chunk_get();
+	log->end = log->buf + REPLAY_CHUNK - REPLAY_SLACK;
+}
+
+/* analysis function; the chunk is full */
+static void PIN_FAST_ANALYSIS_CALL
+replay_submit(thread_ctx_t *thread_ctx)
+{
+	replay_submit_log(thread_ctx->rlog);
+}
+
+/* wait until the worker is done with the first n chunks of the log */
+static void
+replay_wait(replay_log_t *log, UINT64 n)
+{
+	while (log->replayed < n) {
+		PIN_SemaphoreClear(&log->done);
+		if (log->replayed >= n)
+			break;
+		PIN_SemaphoreWait(&log->done);
+	}
+}
+
+/*
+ * replay all the records of a thread; on return, its
+ * tags are those inline propagation would have given
+ *
+ * @log:	the log of the calling thread
+ */
+void
+replay_sync(replay_log_t *log)
+{
+	replay_submit_log(log);
+	replay_wait(log, log->submitted);
+}
+
+/* run a handler with the logged operands */
+static ADDRINT
+replay_call(const replay_call_t *c, thread_ctx_t *tctx, const ADDRINT *dyn)
+{
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn0_t)(void);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn1_t)(ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn2_t)(ADDRINT, ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn3_t)(ADDRINT, ADDRINT,
+			ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn4_t)(ADDRINT, ADDRINT,
+			ADDRINT, ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn5_t)(ADDRINT, ADDRINT,
+			ADDRINT, ADDRINT, ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn6_t)(ADDRINT, ADDRINT,
+			ADDRINT, ADDRINT, ADDRINT, ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn7_t)(ADDRINT, ADDRINT,
+			ADDRINT, ADDRINT, ADDRINT, ADDRINT, ADDRINT);
+	typedef ADDRINT (PIN_FAST_ANALYSIS_CALL *fn8_t)(ADDRINT, ADDRINT,
+			ADDRINT, ADDRINT, ADDRINT, ADDRINT, ADDRINT, ADDRINT);
+	ADDRINT a[REPLAY_MAX_ARGS];
+	size_t i;
+
+	for (i = 0; i < c->nargs; i++)
+		switch (c->kind[i]) {
+			case ARG_CTX:
+				a[i] = (ADDRINT)tctx;
+				break;
+			case ARG_DYN:
+				a[i] = dyn[c->val[i]];
+				break;
+			default:
+				a[i] = c->val[i];
+				break;
+		}
+
+	switch (c->nargs) {
+		case 0:
+			return ((fn0_t)c->fn)();
+		case 1:
+			return ((fn1_t)c->fn)(a[0]);
+		case 2:
+			return ((fn2_t)c->fn)(a[0], a[1]);
+		case 3:
+			return ((fn3_t)c->fn)(a[0], a[1], a[2]);
+		case 4:
+			return ((fn4_t)c->fn)(a[0], a[1], a[2], a[3]);
+		case 5:
+			return ((fn5_t)c->fn)(a[0], a[1], a[2], a[3], a[4]);
+		case 6:
+			return ((fn6_t)c->fn)(a[0], a[1], a[2], a[3], a[4],
+					a[5]);
+		case 7:
+			return ((fn7_t)c->fn)(a[0], a[1], a[2], a[3], a[4],
+					a[5], a[6]);
+		default:
+			return ((fn8_t)c->fn)(a[0], a[1], a[2], a[3], a[4],
+					a[5], a[6], a[7]);
+	}
+}
+
+/* replay the records of a chunk, in order */
+static void
+replay_chunk(const replay_chunk_t *chunk)
+{
+	thread_ctx_t *tctx = chunk->log->tctx;
+	const ADDRINT *p = chunk->begin;
+	const replay_site_t *site;
+	ADDRINT ret;
+	size_t i;
+
+	while (p < chunk->end) {
+		site = &sites[p[0] / REPLAY_SITES_BLK][p[0] % REPLAY_SITES_BLK];
+		/* read by the handlers with MEM_VAL() */
+		for (i = 0; i < site->nval; i++)
+			tctx->rval[i] = p[1 + site->ndyn + i];
+		ret = replay_call(&site->call, tctx, p + 1);
+		if (site->then.fn != NULL && ret)
+			(void)replay_call(&site->then, tctx, p + 1);
+		p += 1 + site->ndyn + site->nval;
+	}
+}
+
+/*
+ * worker (internal thread)
+ *
+ * @v:		the replay_worker_t
+ */
+static VOID
+replay_worker(VOID *v)
+{
+	replay_worker_t *w = (replay_worker_t *)v;
+	replay_chunk_t chunk;
+
+	for (;;) {
+		PIN_GetLock(&w->lock, 1);
+		if (w->queue.empty()) {
+			PIN_SemaphoreClear(&w->work);
+			PIN_ReleaseLock(&w->lock);
+			if (replay_stop)
+				break;
+			PIN_SemaphoreWait(&w->work);
+			continue;
+		}
+		chunk = w->queue.front();
+		w->queue.pop_front();
+		PIN_ReleaseLock(&w->lock);
+
+		replay_chunk(&chunk);
+		chunk_put(chunk.begin);
+
+		/* under the lock; replay_log_free() may follow right away */
+		PIN_GetLock(&w->lock, 1);
+		chunk.log->replayed++;
+		PIN_SemaphoreSet(&chunk.log->done);
+		PIN_ReleaseLock(&w->lock);
+	}
+	PIN_ExitThread(0);
+}
+
+static int
+replay_spawn(void)
+{
+	size_t i;
+
+	for (i = 0; i < nworkers; i++) {
+		PIN_InitLock(&workers[i].lock);
+		PIN_SemaphoreInit(&workers[i].work);
+		workers[i].queue.clear();
+		if (unlikely(PIN_SpawnInternalThread(replay_worker,
+				&workers[i], REPLAY_STACK,
+				&workers[i].uid) == INVALID_THREADID)) {
+			LOG(string(__func__) +
+				": internal thread creation failed\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * allocate the log of a thread
+ *
+ * @tid:	thread id; picks the worker
+ * @tctx:	the thread context that the log is replayed against
+ */
+replay_log_t *
+replay_log_alloc(THREADID tid, thread_ctx_t *tctx)
+{
+	replay_log_t *log = new replay_log_t();
+
+	log->tctx = tctx;
+	log->worker = &workers[tid % nworkers];
+	log->buf = log->cur = chunk_get();
+	log->end = log->buf + REPLAY_CHUNK - REPLAY_SLACK;
+	PIN_SemaphoreInit(&log->done);
+
+	PIN_GetLock(&logs_lock, 1);
+	log->next = logs;
+	logs = log;
+	PIN_ReleaseLock(&logs_lock);
+	return log;
+}
+
+/* replay the rest of the log of an exiting thread and free it */
+void
+replay_log_free(replay_log_t *log)
+{
+	replay_log_t **p;
+
+	replay_sync(log);
+	/* the worker may still be signalling log->done */
+	PIN_GetLock(&log->worker->lock, 1);
+	PIN_ReleaseLock(&log->worker->lock);
+
+	PIN_GetLock(&logs_lock, 1);
+	for (p = &logs; *p != NULL; p = &(*p)->next)
+		if (*p == log) {
+			*p = log->next;
+			break;
+		}
+	PIN_ReleaseLock(&logs_lock);
+
+	chunk_put(log->buf);
+	PIN_SemaphoreFini(&log->done);
+	delete log;
+}
+
+/*
+ * the child only has the forking thread; it gets
+ * its own workers, and the logs of the other threads
+ * of the parent are dropped
+ */
+static void
+replay_fork_before(THREADID tid, const CONTEXT *ctx, VOID *v)
+{
+	thread_ctx_t *tctx = (thread_ctx_t *)
+		PIN_GetContextReg(ctx, thread_ctx_ptr);
+	replay_log_t *log;
+
+	replay_sync(tctx->rlog);
+	PIN_GetLock(&logs_lock, 1);
+	for (log = logs; log != NULL; log = log->next)
+		replay_wait(log, log->submitted);
+	PIN_ReleaseLock(&logs_lock);
+}
+
+static void
+replay_fork_child(THREADID tid, const CONTEXT *ctx, VOID *v)
+{
+	thread_ctx_t *tctx = (thread_ctx_t *)
+		PIN_GetContextReg(ctx, thread_ctx_ptr);
+
+	PIN_InitLock(&logs_lock);
+	PIN_InitLock(&pool_lock);
+	logs = tctx->rlog;
+	logs->next = NULL;
+	logs->submitted = logs->replayed = 0;
+	PIN_SemaphoreInit(&logs->done);
+	if (unlikely(replay_spawn()))
+		libdft_die();
+}
+
+/*
+ * replay what is left in all logs and stop the workers;
+ * must run before the cmp/lea records are flushed at exit
+ */
+void
+replay_fini(void)
+{
+	replay_log_t *log;
+	size_t i;
+
+	if (!replay_on || replay_stop)
+		return;
+
+	/* the application threads are gone; their chunks can be taken */
+	PIN_GetLock(&logs_lock, 1);
+	for (log = logs; log != NULL; log = log->next) {
+		replay_submit_log(log);
+		replay_wait(log, log->submitted);
+	}
+	PIN_ReleaseLock(&logs_lock);
+
+	replay_stop = 1;
+	for (i = 0; i < nworkers; i++)
+		PIN_SemaphoreSet(&workers[i].work);
+	for (i = 0; i < nworkers; i++)
+		(void)PIN_WaitForThreadTermination(workers[i].uid,
+				REPLAY_FINI_WAIT, NULL);
+}
+
+static VOID
+replay_fini_unlocked(INT32 code, VOID *v)
+{
+	replay_fini();
+}
+
+/*
+ * switch libdft to decoupled propagation;
+ * call before libdft_init() and PIN_StartProgram()
+ *
+ * @n:		number of workers; threads are spread over them
+ *
+ * returns: 0 on success, 1 on error
+ */
+int
+replay_init(size_t n)
+{
+	PIN_InitLock(&logs_lock);
+	PIN_InitLock(&pool_lock);
+
+	nworkers = (n > 0) ? n : 1;
+	workers = new replay_worker_t[nworkers];
+	if (unlikely(replay_spawn()))
+		return 1;
+
+	PIN_AddForkFunction(FPOINT_BEFORE, replay_fork_before, NULL);
+	PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, replay_fork_child, NULL);
+	PIN_AddFiniUnlockedFunction(replay_fini_unlocked, NULL);
+
+	replay_on = 1;
+	return 0;
+}
+
+/*
+ * parse the IARG list of a handler call
+ *
+ * @ins:	the instruction
+ * @ap:		the IARGs, up to IARG_END
+ *
+ * IARG_END is not a single IARG: it expands to IARG_FILE_NAME, __FILE__,
+ * IARG_LINE_NO, __LINE__, IARG_LAST, so the list ends at the file name
+ * @c:		the call (fn is set by the caller)
+ * @dyn:	operands to log; the ones of c are appended
+ *
+ * returns: 0 on success, 1 on an IARG that cannot be logged
+ */
+static int
+replay_parse(INS ins, va_list ap, replay_call_t *c, replay_dyn_t *dyn)
+{
+	IARG_TYPE type;
+	REG reg = REG_INVALID();
+	size_t i;
+
+	c->nargs = 0;
+	while ((type = (IARG_TYPE)va_arg(ap, int)) != IARG_FILE_NAME &&
+			type != IARG_LAST) {
+		/* all handlers are fast calls; so are the replayed ones */
+		if (type == IARG_FAST_ANALYSIS_CALL)
+			continue;
+		if (unlikely((i = c->nargs++) == REPLAY_MAX_ARGS))
+			return 1;
+		c->type[i] = type;
+		c->kind[i] = ARG_STATIC;
+		switch (type) {
+			case IARG_UINT32:
+				c->val[i] = va_arg(ap, UINT32);
+				break;
+			case IARG_ADDRINT:
+				c->val[i] = va_arg(ap, ADDRINT);
+				break;
+			case IARG_INST_PTR:
+				c->val[i] = INS_Address(ins);
+				break;
+			case IARG_REG_VALUE:
+				reg = (REG)va_arg(ap, int);
+				if (reg == thread_ctx_ptr) {
+					c->kind[i] = ARG_CTX;
+					break;
+				}
+				/* fall through */
+			case IARG_MEMORYREAD_EA:
+			case IARG_MEMORYREAD2_EA:
+			case IARG_MEMORYWRITE_EA:
+			case IARG_FIRST_REP_ITERATION:
+				if (unlikely(dyn->n == REPLAY_MAX_DYN))
+					return 1;
+				dyn->type[dyn->n] = type;
+				dyn->reg[dyn->n] = (type == IARG_REG_VALUE) ?
+					reg : REG_INVALID();
+				c->kind[i] = ARG_DYN;
+				c->val[i] = dyn->n++;
+				break;
+			default:
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * mark the memory reads of a handler whose values are to be logged
+ * (ins_reads_mem()); they are numbered in the order of its arguments
+ *
+ * @c:		the call
+ * @dyn:	the operands of the call site, c's included
+ *
+ * returns: 0 on success, 1 if there are too many of them
+ */
+static int
+replay_vals(const replay_call_t *c, replay_dyn_t *dyn)
+{
+	size_t i;
+
+	if (!ins_reads_mem(c->fn))
+		return 0;
+	for (i = 0; i < c->nargs; i++)
+		if (c->kind[i] == ARG_DYN &&
+				(c->type[i] == IARG_MEMORYREAD_EA ||
+				c->type[i] == IARG_MEMORYREAD2_EA)) {
+			if (unlikely(dyn->nval == REPLAY_MAX_VAL ||
+					c->val[i] >= REPLAY_VAL_DYN))
+				return 1;
+			dyn->vmask |= 1U << c->val[i];
+			dyn->nval++;
+		}
+	return 0;
+}
+
+/* add the IARG of a logged operand */
+static void
+replay_iarg(IARGLIST args, const replay_dyn_t *dyn, size_t d)
+{
+	if (dyn->type[d] == IARG_REG_VALUE)
+		IARGLIST_AddArguments(args, IARG_REG_VALUE, dyn->reg[d],
+				IARG_END);
+	else
+		IARGLIST_AddArguments(args, dyn->type[d], IARG_END);
+}
+
+/* insert the If/Then call with the original IARGs; pure "if" handlers */
+static void
+replay_forward(int how, INS ins, IPOINT ipoint, const replay_call_t *c,
+		const replay_dyn_t *dyn)
+{
+	IARGLIST args = IARGLIST_Alloc();
+	size_t i;
+
+	for (i = 0; i < c->nargs; i++)
+		if (c->kind[i] == ARG_DYN)
+			replay_iarg(args, dyn, c->val[i]);
+		else if (c->type[i] == IARG_INST_PTR)
+			IARGLIST_AddArguments(args, IARG_INST_PTR, IARG_END);
+		else if (c->type[i] == IARG_UINT32)
+			IARGLIST_AddArguments(args, IARG_UINT32,
+					(UINT32)c->val[i], IARG_END);
+		else
+			IARGLIST_AddArguments(args, IARG_ADDRINT,
+					c->val[i], IARG_END);
+
+	if (how == REPLAY_IF_PREDICATED)
+		INS_InsertIfPredicatedCall(ins, ipoint, c->fn,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_IARGLIST, args, IARG_END);
+	else
+		INS_InsertIfCall(ins, ipoint, c->fn,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_IARGLIST, args, IARG_END);
+	IARGLIST_Free(args);
+}
+
+/* make room for a record; precedes every log writer */
+static void
+replay_check(INS ins, IPOINT ipoint)
+{
+	INS_InsertIfCall(ins, ipoint, (AFUNPTR)replay_full,
+			IARG_FAST_ANALYSIS_CALL,
+			IARG_REG_VALUE, thread_ctx_ptr,
+			IARG_END);
+	INS_InsertThenCall(ins, ipoint, (AFUNPTR)replay_submit,
+			IARG_FAST_ANALYSIS_CALL,
+			IARG_REG_VALUE, thread_ctx_ptr,
+			IARG_END);
+}
+
+/* store a call site and insert its log writer */
+static void
+replay_record(int how, INS ins, IPOINT ipoint, replay_site_t *site,
+		const replay_dyn_t *dyn)
+{
+	IARGLIST args;
+	AFUNPTR rec = replay_recs[dyn->n];
+	ADDRINT id = nsites;
+	size_t d;
+
+	if (unlikely(id / REPLAY_SITES_BLK == REPLAY_SITES_MAX)) {
+		LOG(string(__func__) + ": out of call sites\n");
+		return;
+	}
+	if (unlikely(dyn->nval > 0 && dyn->n > REPLAY_VAL_DYN)) {
+		LOG(string(__func__) + ": dropped handler at " +
+			StringFromAddrint(INS_Address(ins)) + "\n");
+		return;
+	}
+	if (sites[id / REPLAY_SITES_BLK] == NULL)
+		sites[id / REPLAY_SITES_BLK] =
+			new replay_site_t[REPLAY_SITES_BLK];
+	site->ndyn = dyn->n;
+	site->nval = dyn->nval;
+	sites[id / REPLAY_SITES_BLK][id % REPLAY_SITES_BLK] = *site;
+	nsites++;
+
+	args = IARGLIST_Alloc();
+	if (dyn->nval > 0) {
+		rec = (AFUNPTR)replay_recv;
+		IARGLIST_AddArguments(args,
+				IARG_UINT32, (UINT32)dyn->n,
+				IARG_UINT32, dyn->vmask,
+				IARG_MEMORYREAD_SIZE,
+				IARG_END);
+	}
+	for (d = 0; d < dyn->n; d++)
+		replay_iarg(args, dyn, d);
+	for (; dyn->nval > 0 && d < REPLAY_VAL_DYN; d++)
+		IARGLIST_AddArguments(args, IARG_ADDRINT, (ADDRINT)0,
+				IARG_END);
+
+	switch (how) {
+		case REPLAY_PREDICATED:
+			INS_InsertPredicatedCall(ins, ipoint,
+				rec,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_REG_VALUE, thread_ctx_ptr,
+				IARG_ADDRINT, id,
+				IARG_IARGLIST, args,
+				IARG_END);
+			break;
+		case REPLAY_THEN:
+			INS_InsertThenCall(ins, ipoint,
+				rec,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_REG_VALUE, thread_ctx_ptr,
+				IARG_ADDRINT, id,
+				IARG_IARGLIST, args,
+				IARG_END);
+			break;
+		case REPLAY_THEN_PREDICATED:
+			INS_InsertThenPredicatedCall(ins, ipoint,
+				rec,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_REG_VALUE, thread_ctx_ptr,
+				IARG_ADDRINT, id,
+				IARG_IARGLIST, args,
+				IARG_END);
+			break;
+		default:
+			INS_InsertCall(ins, ipoint,
+				rec,
+				IARG_FAST_ANALYSIS_CALL,
+				IARG_REG_VALUE, thread_ctx_ptr,
+				IARG_ADDRINT, id,
+				IARG_IARGLIST, args,
+				IARG_END);
+			break;
+	}
+	IARGLIST_Free(args);
+}
+
+/* whether a handler uses the thread context (i.e., the tags) */
+static int
+replay_uses_ctx(const replay_call_t *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nargs; i++)
+		if (c->kind[i] == ARG_CTX)
+			return 1;
+	return 0;
+}
+
+/*
+ * log a handler call of ins_inspect() instead of inserting it
+ *
+ * "if" handlers that only test operands (rep_predicate()) stay
+ * inline and guard the log writer of their "then" handler; the
+ * ones that update tags are logged together with their "then"
+ * handler, and the pair is replayed as one
+ *
+ * @how:	REPLAY_*; the INS_Insert*Call() that was called
+ * @ins:	the instruction
+ * @ipoint:	the instrumentation point
+ * @fn:		the handler
+ */
+void
+replay_insert(int how, INS ins, IPOINT ipoint, AFUNPTR fn, ...)
+{
+	replay_site_t site;
+	replay_dyn_t dyn;
+	va_list ap;
+	int err;
+
+	memset(&site, 0, sizeof(site));
+	memset(&dyn, 0, sizeof(dyn));
+	va_start(ap, fn);
+
+	switch (how) {
+		case REPLAY_IF:
+		case REPLAY_IF_PREDICATED:
+			pending_if = IF_NONE;
+			site.call.fn = fn;
+			if (unlikely(replay_parse(ins, ap, &site.call, &dyn) ||
+					replay_vals(&site.call, &dyn)))
+				break;
+			if (replay_uses_ctx(&site.call)) {
+				pending_call = site.call;
+				pending_dyn = dyn;
+				pending_if = IF_TAINT;
+				break;
+			}
+			replay_check(ins, ipoint);
+			replay_forward(how, ins, ipoint, &site.call, &dyn);
+			pending_if = IF_PURE;
+			break;
+		case REPLAY_THEN:
+		case REPLAY_THEN_PREDICATED:
+			if (pending_if == IF_TAINT) {
+				site.call = pending_call;
+				dyn = pending_dyn;
+				site.then.fn = fn;
+				err = replay_parse(ins, ap, &site.then, &dyn) ||
+					replay_vals(&site.then, &dyn);
+				if (likely(!err)) {
+					replay_check(ins, ipoint);
+					replay_record(how == REPLAY_THEN ?
+						REPLAY_CALL : REPLAY_PREDICATED,
+						ins, ipoint, &site, &dyn);
+				}
+			}
+			else if (pending_if == IF_PURE) {
+				site.call.fn = fn;
+				err = replay_parse(ins, ap, &site.call, &dyn) ||
+					replay_vals(&site.call, &dyn);
+				if (likely(!err))
+					replay_record(how, ins, ipoint,
+							&site, &dyn);
+			}
+			else
+				err = 1;
+			if (unlikely(err))
+				LOG(string(__func__) + ": dropped handler at " +
+					StringFromAddrint(INS_Address(ins)) +
+					"\n");
+			pending_if = IF_NONE;
+			break;
+		default:
+			site.call.fn = fn;
+			if (unlikely(replay_parse(ins, ap, &site.call, &dyn) ||
+					replay_vals(&site.call, &dyn))) {
+				LOG(string(__func__) + ": dropped handler at " +
+					StringFromAddrint(INS_Address(ins)) +
+					"\n");
+				break;
+			}
+			replay_check(ins, ipoint);
+			replay_record(how, ins, ipoint, &site, &dyn);
+			break;
+	}
+	va_end(ap);
+}
@@ -0,0 +1,47 @@
+#ifndef __LIBDFT_REPLAY_H__
+#define __LIBDFT_REPLAY_H__
+
+#include "pin.H"
+#include "libdft_api.h"
+
+/*
+ * decoupled propagation (record/replay)
+ *
+ * once replay_init() is called, ins_inspect() no longer inserts the
+ * propagation handlers into the program; every handler call is turned
+ * into a record of a per-thread log instead: the call site, and the
+ * operands that are only known at run time (register values, effective
+ * addresses, and the memory that the compare handlers read, which may
+ * have changed by the time they run). Internal threads replay the logs
+ * with the same handlers, so the cmp/lea/token/patch records are those
+ * of inline propagation, while the program itself only pays for a few
+ * stores per handler.
+ *
+ * The syscall hooks read and update the tagmap, so a thread's log is
+ * fully replayed before each of its syscalls, when it exits, before a
+ * fork, and at exit (replay_fini())
+ */
+enum {
+/* #define */ REPLAY_CALL = 0,		/* INS_InsertCall() */
+/* #define */ REPLAY_PREDICATED = 1,	/* INS_InsertPredicatedCall() */
+/* #define */ REPLAY_IF = 2,		/* INS_InsertIfCall() */
+/* #define */ REPLAY_IF_PREDICATED = 3,	/* INS_InsertIfPredicatedCall() */
+/* #define */ REPLAY_THEN = 4,		/* INS_InsertThenCall() */
+/* #define */ REPLAY_THEN_PREDICATED = 5	/* INS_InsertThenPredicatedCall() */
+};
+
+/* non-zero after replay_init() */
+extern int replay_on;
+
+int	replay_init(size_t);
+void	replay_fini(void);
+
+/* per-thread logs; see thread_alloc() and thread_free() */
+struct replay_log *replay_log_alloc(THREADID, thread_ctx_t *);
+void	replay_log_free(struct replay_log *);
+void	replay_sync(struct replay_log *);
+
+/* used in place of the INS_Insert*Call() of ins_inspect() */
+void	replay_insert(int, INS, IPOINT, AFUNPTR, ...);
+
+#endif /* __LIBDFT_REPLAY_H__ */
@@ -152,6 +152,24 @@ bool tag_count(std::bitset<TAG_BITSET_SIZE> const & tag) {
 	}
 }
 
+template<>
+bool tag_live(std::bitset<TAG_BITSET_SIZE> const & tag) {
+	return tag.any();
+}
+
+template<>
+bool tag_single(std::bitset<TAG_BITSET_SIZE> const & tag, uint32_t & off) {
+	if(tag.count() != 1)
+		return 0;
+	for(size_t i = 0; i < TAG_BITSET_SIZE; i++){
+		if(tag.test(i)){
+			off = i;
+			break;
+		}
+	}
+	return 1;
+}
+
 /* *** EWAHBoolArray based tags. ****************************************/
 /*
    define the set/cleared values
@@ -194,6 +212,52 @@ bool tag_count(EWAHBoolArray<uint32_t> const & tag) {
 	}
 }
 
+/* tags are only ever combined (or'ed); an empty one has no bits at all */
+template<>
+bool tag_live(EWAHBoolArray<uint32_t> const & tag) {
+	return tag.sizeInBits() != 0;
+}
+
+template<>
+bool tag_single(EWAHBoolArray<uint32_t> const & tag, uint32_t & off) {
+	if(tag.numberOfOnes() != 1)
+		return 0;
+	off = *tag.begin();
+	return 1;
+}
+
+template<>
+int tag_snprint(EWAHBoolArray<uint32_t> const & tag, char *buf, size_t n) {
+	char dec[10];
+	size_t pos = 0, len;
+	int noff = 0;
+	uint32_t v;
+
+	/* "{" + "}" + NUL */
+	if(n < 3)
+		return -1;
+	buf[pos++] = '{';
+	for(EWAHBoolArray<uint32_t>::const_iterator i = tag.begin(); i != tag.end(); ++i){
+		v = *i;
+		len = 0;
+		do {
+			dec[len++] = '0' + (v % 10);
+			v /= 10;
+		} while(v);
+		/* separator + digits + "}" + NUL */
+		if(pos + (noff ? 1 : 0) + len + 2 > n)
+			return -1;
+		if(noff)
+			buf[pos++] = ',';
+		while(len)
+			buf[pos++] = dec[--len];
+		noff++;
+	}
+	buf[pos++] = '}';
+	buf[pos] = '\0';
+	return noff;
+}
+
 /* *** bvector<> based tags. ****************************************/
 /*
    define the set/cleared values
@@ -245,4 +309,12 @@ bool tag_count(bm::bvector<> const & tag) {
 	else
 		return 0;
 }
+
+template<>
+bool tag_single(bm::bvector<> const & tag, uint32_t & off) {
+	if(tag.count() != 1)
+		return 0;
+	off = tag.get_first();
+	return 1;
+}
 /* vim: set noet ts=4 sts=4 : */
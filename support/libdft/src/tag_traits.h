@@ -24,6 +24,39 @@ template<typename T> std::string tag_sprint(T const & tag);
 /* count the offsets */
 template<typename T> bool tag_count(T const & tag);
 
+/* check for a single offset; stores it in off */
+template<typename T> bool tag_single(T const & tag, uint32_t & off);
+
+/*
+ * check for a tag that may hold offsets in O(1); never false for
+ * a tag that holds some, always false for cleared_val
+ */
+template<typename T> bool tag_live(T const & tag)
+{
+	return tag_count(tag);
+}
+
+/*
+ * print to a fixed-size buffer (no heap allocation for the tag types
+ * that specialize it); returns the number of offsets printed, or -1
+ * if they do not fit in the buffer
+ */
+template<typename T> int tag_snprint(T const & tag, char *buf, size_t n)
+{
+	std::string s = tag_sprint(tag);
+	int noff = 0;
+
+	if (s.size() >= n)
+		return -1;
+	for (size_t i = 0; i < s.size(); i++) {
+		buf[i] = s[i];
+		if (s[i] == ',')
+			noff++;
+	}
+	buf[s.size()] = '\0';
+	return (s.size() > 2) ? noff + 1 : 0;
+}
+
 
 /********************************************************
  uint8_t tags
@@ -131,6 +164,12 @@ std::string tag_sprint(std::bitset<TAG_BITSET_SIZE> const & tag);
 template<>
 bool tag_count(std::bitset<TAG_BITSET_SIZE> const & tag);
 
+template<>
+bool tag_single(std::bitset<TAG_BITSET_SIZE> const & tag, uint32_t & off);
+
+template<>
+bool tag_live(std::bitset<TAG_BITSET_SIZE> const & tag);
+
 /********************************************************
  EWAHBoolArray tags bitset tags
  ********************************************************/
@@ -158,6 +197,15 @@ std::string tag_sprint(EWAHBoolArray<uint32_t> const & tag);
 template<>
 bool tag_count(EWAHBoolArray<uint32_t> const & tag);
 
+template<>
+bool tag_single(EWAHBoolArray<uint32_t> const & tag, uint32_t & off);
+
+template<>
+int tag_snprint(EWAHBoolArray<uint32_t> const & tag, char *buf, size_t n);
+
+template<>
+bool tag_live(EWAHBoolArray<uint32_t> const & tag);
+
 /********************************************************
  bvector bitset tags
  ********************************************************/
@@ -185,6 +233,9 @@ std::string tag_sprint(bm::bvector<> const & tag);
 template<>
 bool tag_count(bm::bvector<> const & tag);
 
+template<>
+bool tag_single(bm::bvector<> const & tag, uint32_t & off);
+
 #endif /* TAG_TRAITS_H */
 
 /* vim: set noet ts=4 sts=4 : */
@@ -67,6 +67,8 @@
 uint8_t *bitmap = NULL;
 #else
 tag_dir_t tag_dir{};
+volatile long tagmap_live = 0;
+int tagmap_track = 0;
 #endif
 
 /*
@@ -31,6 +31,10 @@ typedef std::array<tag_table_t*, DIR_SZ> tag_dir_t;
 extern int tagmap_all_tainted;
 extern void libdft_die();
 
+/* bytes of the tagmap with a live tag (tag_live()); counted if tagmap_track */
+extern volatile long tagmap_live;
+extern int tagmap_track;
+
 inline tag_t const * tag_dir_getb_as_ptr(tag_dir_t const & dir, ADDRINT addr) {
     if(dir[virt2table(addr)]) {
         tag_table_t * table = dir[virt2table(addr)];
@@ -78,7 +82,14 @@ inline void tag_dir_setb(tag_dir_t & dir, ADDRINT addr, tag_t const & tag)
     }
 
     tag_page_t * page = (*table)[virt2page(addr)];
+    tag_t & old = (*page)[virt2offset(addr)];
     //LOG("Writing tag for "+hexstr(addr)+"\n");
-    (*page)[virt2offset(addr)] = tag;
+    if (tagmap_track) {
+        bool was_live = tag_live(old);
+        bool is_live = tag_live(tag);
+        if (was_live != is_live)
+            __sync_fetch_and_add(&tagmap_live, is_live ? 1 : -1);
+    }
+    old = tag;
 }
 #endif